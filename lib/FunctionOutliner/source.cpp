@@ -1,9 +1,13 @@
 #include <algorithm>
+#include <map>
+#include <vector>
 
+#include "llvm/ADT/Hashing.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
@@ -12,17 +16,69 @@
 
 namespace llvm {
 struct FunctionOutliner : public PassInfoMixin<FunctionOutliner> {
+    // outlined functions bucketed by the hash of the instruction they hold.
+    // the pass outlives them and later passes may delete them, so each
+    // entry turns null when its function is deleted
+    std::map<size_t, std::vector<WeakVH>> shapes;
+
+    // operands that are passed to the outlined function rather than cloned
+    static bool isPassedOperand(Value *V) {
+        return isa<Instruction>(V) || isa<Argument>(V);
+    }
+
+    // hash of everything the outlined function depends on: opcode, types,
+    // flags and the operands that stay inside the function
+    static size_t hashShape(Instruction *I) {
+        hash_code h = hash_combine(I->getOpcode(), I->getType(),
+                                   I->getRawSubclassOptionalData());
+        for (Value *op : I->operands()) {
+            h = hash_combine(h, op->getType(),
+                             isPassedOperand(op) ? nullptr : op);
+        }
+        return h;
+    }
+
+    // whether newFunc computes I given I's passed operands in order
+    static bool hasShape(Function *newFunc, Instruction *I) {
+        Instruction *insn = &newFunc->getEntryBlock().front();
+        if (!insn->isSameOperationAs(I)) {
+            return false;
+        }
+        for (unsigned i = 0; i < I->getNumOperands(); i++) {
+            Value *op = I->getOperand(i);
+            if (isPassedOperand(op) ? !isa<Argument>(insn->getOperand(i))
+                                    : insn->getOperand(i) != op) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Function *getFunc(Instruction *I, Function &parent) {
+        std::vector<WeakVH> &bucket = shapes[hashShape(I)];
+        bucket.erase(std::remove(bucket.begin(), bucket.end(), nullptr),
+                     bucket.end());
+        for (WeakVH &VH : bucket) {
+            Function *func = cast<Function>(VH);
+            if (func->getParent() == parent.getParent() && hasShape(func, I)) {
+                return func;
+            }
+        }
+        Function *newFunc = createFunc(I, parent);
+        bucket.push_back(newFunc);
+        return newFunc;
+    }
+
     Function *createFunc(Instruction *I, Function &parent) {
         std::vector<Type *> args;
-        std::vector<Value *> needsRemap;
+        std::vector<unsigned> needsRemap;
         Instruction *insn = I->clone();
-        for (int i = 0; i < insn->getNumOperands(); i++) {
-            if (auto *instArg = dyn_cast<Instruction>(insn->getOperand(i))) {
+        // the function is shared, so it has no single source location
+        insn->setDebugLoc(DebugLoc());
+        for (unsigned i = 0; i < insn->getNumOperands(); i++) {
+            if (isPassedOperand(insn->getOperand(i))) {
                 args.push_back(insn->getOperand(i)->getType());
-                needsRemap.push_back(insn->getOperand(i));
-            } else if (auto funcArg = dyn_cast<Argument>(insn->getOperand(i))) {
-                args.push_back(insn->getOperand(i)->getType());
-                needsRemap.push_back(insn->getOperand(i));
+                needsRemap.push_back(i);
             }
         }
         Type *returnType = nullptr;
@@ -34,9 +90,10 @@ struct FunctionOutliner : public PassInfoMixin<FunctionOutliner> {
         Function *newFunc = Function::Create(
             FunctionType::get(returnType, args, false),
             GlobalValue::LinkageTypes::InternalLinkage, "", parent.getParent());
-        // remap instruction operands in function
-        for (int i = 0; i < needsRemap.size(); i++) {
-            insn->replaceUsesOfWith(needsRemap[i], newFunc->getArg(i));
+        // remap instruction operands in function, one argument per operand
+        // so that repeated operands do not change the shape
+        for (unsigned i = 0; i < needsRemap.size(); i++) {
+            insn->setOperand(needsRemap[i], newFunc->getArg(i));
         }
         BasicBlock *BB1 = BasicBlock::Create(parent.getParent()->getContext(),
                                              "entry", newFunc);
@@ -51,21 +108,23 @@ struct FunctionOutliner : public PassInfoMixin<FunctionOutliner> {
     }
 
     PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
-        std::vector<std::string> shouldIgnore{"alloca", "ret", "br", "switch"};
+        std::vector<std::string> shouldIgnore{"alloca", "ret", "br", "switch",
+                                             "phi"};
         if (F.getName() == "") {
             return PreservedAnalyses::none();
         }
 
-        std::map<Instruction *, Function *> insnMapping;
+        // kept in program order so the output is reproducible
+        std::vector<std::pair<Instruction *, Function *>> insnMapping;
 
         for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
             Instruction *insn = &*I;
             Function *tempFunc = nullptr;
             if (std::find(shouldIgnore.begin(), shouldIgnore.end(),
                           insn->getOpcodeName()) == shouldIgnore.end()) {
-                tempFunc = createFunc(insn, F);
+                tempFunc = getFunc(insn, F);
             }
-            insnMapping.insert({insn, tempFunc});
+            insnMapping.push_back({insn, tempFunc});
         }
 
         for (auto itr = insnMapping.begin(); itr != insnMapping.end(); ++itr) {
@@ -74,14 +133,10 @@ struct FunctionOutliner : public PassInfoMixin<FunctionOutliner> {
             if (func) {
                 // craft call instruction
                 std::vector<Value *> args;
-                for (int i = 0; i < insn->getNumOperands(); i++) {
+                for (unsigned i = 0; i < insn->getNumOperands(); i++) {
                     // ensure we do not destory an IR by moving it into a
                     // function
-                    if (auto *instArg =
-                            dyn_cast<Instruction>(insn->getOperand(i))) {
-                        args.push_back(insn->getOperand(i));
-                    } else if (auto funcArg =
-                                   dyn_cast<Argument>(insn->getOperand(i))) {
+                    if (isPassedOperand(insn->getOperand(i))) {
                         args.push_back(insn->getOperand(i));
                     }
                 }
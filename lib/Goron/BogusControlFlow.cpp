@@ -687,7 +687,8 @@ PreservedAnalyses BogusControlFlowPass::run(Function &F,
     return PreservedAnalyses::all();
   }
   // If fla annotations
-  if (toObfuscate(BogusControlFlow, &F, "bcf")) {
+  if (toObfuscate(BogusControlFlow, &F, "bcf", AM)) {
+    CryptoStream CS(F.getName(), "bcf");
     bogus(F);
     doF(*F.getParent(), F);
     return PreservedAnalyses::none();
@@ -26,6 +26,7 @@
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 
 #include <cassert>
 #include <cstdio>
@@ -54,6 +55,9 @@ ManagedStatic<CryptoUtils> cryptoutils;
 static cl::opt<std::string> AesSeed("aesSeed", cl::init(""),
                                     cl::desc("seed for the AES-CTR PRNG"));
 
+// Innermost CryptoStream of the calling thread, if any
+static thread_local CryptoStream *ActiveStream = nullptr;
+
 const uint32_t AES_RCON[10] = {
     0x01000000UL, 0x02000000UL, 0x04000000UL, 0x08000000UL, 0x10000000UL,
     0x20000000UL, 0x40000000UL, 0x80000000UL, 0x1b000000UL, 0x36000000UL};
@@ -509,44 +513,47 @@ CryptoUtils::CryptoUtils() {
   }
 }
 
-unsigned CryptoUtils::scramble32(const unsigned in, const char key[16]) {
-  assert(key != NULL && "CryptoUtils::scramble key=NULL");
-
-  unsigned tmpA, tmpB;
-
-  // Orr, Nathan or Adi can probably break it, but who cares?
-
-  // Round 1
-  tmpA = 0x0;
-  tmpA ^= AES_PRECOMP_TE0[((in >> 24) ^ key[0]) & 0xFF];
-  tmpA ^= AES_PRECOMP_TE1[((in >> 16) ^ key[1]) & 0xFF];
-  tmpA ^= AES_PRECOMP_TE2[((in >> 8) ^ key[2]) & 0xFF];
-  tmpA ^= AES_PRECOMP_TE3[((in >> 0) ^ key[3]) & 0xFF];
-
-  // Round 2
-  tmpB = 0x0;
-  tmpB ^= AES_PRECOMP_TE0[((tmpA >> 24) ^ key[4]) & 0xFF];
-  tmpB ^= AES_PRECOMP_TE1[((tmpA >> 16) ^ key[5]) & 0xFF];
-  tmpB ^= AES_PRECOMP_TE2[((tmpA >> 8) ^ key[6]) & 0xFF];
-  tmpB ^= AES_PRECOMP_TE3[((tmpA >> 0) ^ key[7]) & 0xFF];
-
-  // Round 3
-  tmpA = 0x0;
-  tmpA ^= AES_PRECOMP_TE0[((tmpB >> 24) ^ key[8]) & 0xFF];
-  tmpA ^= AES_PRECOMP_TE1[((tmpB >> 16) ^ key[9]) & 0xFF];
-  tmpA ^= AES_PRECOMP_TE2[((tmpB >> 8) ^ key[10]) & 0xFF];
-  tmpA ^= AES_PRECOMP_TE3[((tmpB >> 0) ^ key[11]) & 0xFF];
-
-  // Round 4
-  tmpB = 0x0;
-  tmpB ^= AES_PRECOMP_TE0[((tmpA >> 24) ^ key[12]) & 0xFF];
-  tmpB ^= AES_PRECOMP_TE1[((tmpA >> 16) ^ key[13]) & 0xFF];
-  tmpB ^= AES_PRECOMP_TE2[((tmpA >> 8) ^ key[14]) & 0xFF];
-  tmpB ^= AES_PRECOMP_TE3[((tmpA >> 0) ^ key[15]) & 0xFF];
+void CryptoUtils::scramble_key(ScrambleKey &key, const unsigned range) {
+  for (unsigned i = 0; i < 4; i++) {
+    key.round[i] = get_uint32_t();
+  }
+  key.range = range;
+  key.base = 0;
+  key.halfBits = 16;
+
+  // Smallest even bit width covering the range, so that cycle-walking back
+  // into it takes less than four rounds of the network on average
+  if (range != 0) {
+    key.halfBits = 1;
+    while (key.halfBits < 16 && (1ULL << (2 * key.halfBits)) < range) {
+      key.halfBits++;
+    }
+    key.base = get_range(0xFFFFFFFF - range);
+  }
+}
 
-  LOAD32H(tmpA, key);
+unsigned CryptoUtils::scramble32(const unsigned in, const ScrambleKey &key) {
+  assert((key.range == 0 || in < key.range) &&
+         "CryptoUtils::scramble32 index out of range");
+
+  const uint32_t mask = (1U << key.halfBits) - 1;
+  uint32_t v = in;
+
+  do {
+    uint32_t l = v >> key.halfBits, r = v & mask;
+    for (unsigned i = 0; i < 4; i++) {
+      uint32_t f = r * 0x9E3779B1U + key.round[i];
+      f ^= f >> 15;
+      f *= 0x85EBCA77U;
+      f ^= f >> 13;
+      uint32_t t = l ^ (f & mask);
+      l = r;
+      r = t;
+    }
+    v = (l << key.halfBits) | r;
+  } while (key.range != 0 && v >= key.range);
 
-  return tmpA ^ tmpB;
+  return key.base + v;
 }
 
 bool CryptoUtils::prng_seed(const std::string _seed) {
@@ -736,6 +743,11 @@ void CryptoUtils::get_bytes(char *buffer, const int len) {
 
   statsGetBytes++;
 
+  if (ActiveStream) {
+    ActiveStream->get_bytes(buffer, len);
+    return;
+  }
+
   if (len > 0) {
 
     // If the PRNG is not seeded, it the very last time to do it !
@@ -762,6 +774,51 @@ void CryptoUtils::get_bytes(char *buffer, const int len) {
   }
 }
 
+CryptoStream::CryptoStream(StringRef Name, StringRef PassID) {
+  // The stream key is the seed key applied to (H(Name), H(PassID)), and the
+  // stream then runs AES-CTR under it from a zero counter.
+  char tweak[16], skey[16];
+  if (!cryptoutils->seeded) {
+    cryptoutils->prng_seed();
+    cryptoutils->populate_pool();
+  }
+  STORE64H(tweak, xxHash64(Name));
+  STORE64H(tweak + 8, xxHash64(PassID));
+  cryptoutils->aes_encrypt(skey, tweak, cryptoutils->ks);
+  cryptoutils->aes_compute_ks(ks, skey);
+  memset(skey, 0, sizeof(skey));
+  memset(ctr, 0, sizeof(ctr));
+  idx = sizeof(buf);
+  prev = ActiveStream;
+  ActiveStream = this;
+}
+
+CryptoStream::~CryptoStream() {
+  assert(ActiveStream == this && "CryptoStreams must be nested");
+  ActiveStream = prev;
+  memset(ks, 0, sizeof(ks));
+  memset(buf, 0, sizeof(buf));
+}
+
+void CryptoStream::get_bytes(char *buffer, int len) {
+  while (len > 0) {
+    if (idx == sizeof(buf)) {
+      for (unsigned i = 0; i < sizeof(buf); i += 16) {
+        uint64_t c;
+        LOAD64H(c, ctr + 8);
+        STORE64H(ctr + 8, c + 1);
+        cryptoutils->aes_encrypt(buf + i, ctr, ks);
+      }
+      idx = 0;
+    }
+    int n = MIN(len, (int)(sizeof(buf) - idx));
+    memcpy(buffer, buf + idx, n);
+    idx += n;
+    buffer += n;
+    len -= n;
+  }
+}
+
 uint8_t CryptoUtils::get_uint8_t() {
   char ret;
 
@@ -18,6 +18,7 @@
 #ifndef LLVM_CRYPTOUTILS_H
 #define LLVM_CRYPTOUTILS_H
 
+#include "llvm/ADT/StringRef.h"
 #include "llvm/Support/ManagedStatic.h"
 
 #include <stdint.h>
@@ -208,6 +209,16 @@ extern ManagedStatic<CryptoUtils> cryptoutils;
     ((unsigned long)(x) << (unsigned long)(32 - ((y) & 31)))) &                \
    0xFFFFFFFFUL)
 
+// Key of the permutation computed by CryptoUtils::scramble32. A zero range
+// permutes the whole 32-bit space; otherwise [0, range[ is mapped onto the
+// contiguous window [base, base + range[.
+struct ScrambleKey {
+  uint32_t round[4];
+  uint32_t range;
+  uint32_t base;
+  uint32_t halfBits;
+};
+
 class CryptoUtils {
 public:
   CryptoUtils();
@@ -215,6 +226,10 @@ public:
 
   char *get_seed();
   void get_bytes(char *buffer, const int len);
+  // Fill a whole buffer of N elements with one call
+  template <typename T> void fill(T *buffer, size_t n) {
+    get_bytes(reinterpret_cast<char *>(buffer), n * sizeof(T));
+  }
   char get_char();
   bool prng_seed(const std::string seed);
 
@@ -227,8 +242,11 @@ public:
   // Returns a uniformly distributed 64-bit value
   uint64_t get_uint64_t();
 
-  // Scramble a 32-bit value depending on a 128-bit value
-  unsigned scramble32(const unsigned in, const char key[16]);
+  // Draws a fresh key for scramble32, optionally restricted to a range
+  void scramble_key(ScrambleKey &key, const unsigned range = 0);
+  // Keyed 4-round Feistel permutation: distinct inputs always give distinct
+  // outputs, at a few multiplies per value instead of four AES rounds.
+  unsigned scramble32(const unsigned in, const ScrambleKey &key);
 
   int sha256(const char *msg, unsigned char *hash);
 
@@ -257,6 +275,28 @@ private:
   static int sha256_compress(sha256_state *md, unsigned char *buf);
   int sha256_process(sha256_state *md, const unsigned char *in,
                      unsigned long inlen);
+
+  friend class CryptoStream;
+};
+
+// AES-CTR stream keyed by (seed, Name, PassID). While a CryptoStream is alive,
+// cryptoutils draws from it on the constructing thread instead of the shared
+// pool, so what a pass generates for one function doesn't depend on how many
+// bytes were consumed for other functions before it.
+class CryptoStream {
+public:
+  CryptoStream(StringRef Name, StringRef PassID);
+  ~CryptoStream();
+
+private:
+  friend class CryptoUtils;
+  void get_bytes(char *buffer, int len);
+
+  uint32_t ks[44];
+  char ctr[16];
+  char buf[64];
+  unsigned idx;
+  CryptoStream *prev;
 };
 }
 
@@ -23,8 +23,8 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Utils/Local.h" // For DemoteRegToStack and DemotePHIToStack
 #include "llvm/Transforms/Utils/LowerSwitch.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 
 using namespace llvm;
 using namespace std;
@@ -32,63 +32,89 @@ using namespace std;
 #define DEBUG_TYPE "flattening"
 
 STATISTIC(Flattened, "Functions flattened");
+STATISTIC(DemotedSlots, "Stack slots created by demotion");
 
 namespace {
 cl::opt<bool> Flattening("fla", cl::init(true),
                          cl::desc("Enable the flattening pass"));
+cl::opt<bool> FlatteningDense("fla_dense", cl::init(false),
+                              cl::desc("Keep flattening case values "
+                                       "contiguous for jump-table lowering"));
+cl::opt<bool> FlatteningSSA("fla_ssa", cl::init(false),
+                            cl::desc("Keep values in SSA form through the "
+                                     "flattening dispatcher"));
+
+// SSA-preserving alternative to fixStack: instead of demoting, every value
+// that no longer dominates its uses is carried around the dispatch loop by
+// SSAUpdater PHIs in loopEntry/loopEnd.
+void rebuildSSA(vector<BasicBlock *> &origBB, BasicBlock *loopEntry) {
+  vector<PHINode *> tmpPhi;
+  vector<PHINode *> newPhi;
+  for (vector<BasicBlock *>::iterator b = origBB.begin(); b != origBB.end();
+       ++b) {
+    for (PHINode &PN : (*b)->phis()) {
+      tmpPhi.push_back(&PN);
+    }
+  }
 
-// Shamefully borrowed from ../Scalar/RegToMem.cpp :(
-bool valueEscapes(const Instruction &Inst) {
-  if (!Inst.getType()->isSized())
-    return false;
-
-  const BasicBlock *BB = Inst.getParent();
-  for (const User *U : Inst.users()) {
-    const Instruction *UI = cast<Instruction>(U);
-    if (UI->getParent() != BB || isa<PHINode>(UI))
-      return true;
+  // A PHI's operands are defined at the end of its incoming blocks, one of
+  // which is always the last block run before it. The PHI itself becomes a
+  // single-entry PHI off loopEntry so a later use still sees its own value.
+  // The stale PHIs are unlinked first: SSAUpdater reads predecessors off them.
+  for (unsigned int i = 0; i != tmpPhi.size(); ++i) {
+    PHINode *PN = tmpPhi.at(i);
+    PHINode *NewPN = PHINode::Create(PN->getType(), 1, PN->getName(), PN);
+    NewPN->addIncoming(UndefValue::get(PN->getType()), loopEntry);
+    PN->replaceAllUsesWith(NewPN);
+    PN->removeFromParent();
+    newPhi.push_back(NewPN);
+  }
+  for (unsigned int i = 0; i != tmpPhi.size(); ++i) {
+    PHINode *PN = tmpPhi.at(i);
+    SSAUpdater SSA;
+    SSA.Initialize(PN->getType(), PN->getName());
+    for (unsigned int j = 0; j != PN->getNumIncomingValues(); ++j) {
+      SSA.AddAvailableValue(PN->getIncomingBlock(j), PN->getIncomingValue(j));
+    }
+    newPhi.at(i)->setIncomingValue(0, SSA.GetValueAtEndOfBlock(loopEntry));
+  }
+  for (unsigned int i = 0; i != tmpPhi.size(); ++i) {
+    tmpPhi.at(i)->dropAllReferences();
+  }
+  for (unsigned int i = 0; i != tmpPhi.size(); ++i) {
+    tmpPhi.at(i)->deleteValue();
   }
-  return false;
-}
 
-void fixStack(Function &F) {
-  // Try to remove phi node and demote reg to stack
-  std::vector<PHINode *> tmpPhi;
-  std::vector<Instruction *> tmpReg;
-  BasicBlock *bbEntry = &*F.begin();
-
-  do {
-    tmpPhi.clear();
-    tmpReg.clear();
-
-    for (Function::iterator i = F.begin(); i != F.end(); ++i) {
-
-      for (BasicBlock::iterator j = i->begin(); j != i->end(); ++j) {
-
-        if (isa<PHINode>(j)) {
-          PHINode *phi = cast<PHINode>(j);
-          tmpPhi.push_back(phi);
-          continue;
-        }
-        if (!(isa<AllocaInst>(j) && j->getParent() == bbEntry) &&
-            (valueEscapes(*j) || j->isUsedOutsideOfBlock(&*i))) {
-          tmpReg.push_back(&*j);
-          continue;
-        }
+  // Anything else dominated its uses before, so the copy that reaches a use
+  // is always the latest definition.
+  vector<Instruction *> tmpReg;
+  for (vector<BasicBlock *>::iterator b = origBB.begin(); b != origBB.end();
+       ++b) {
+    for (Instruction &I : **b) {
+      if (valueEscapes(I)) {
+        tmpReg.push_back(&I);
       }
     }
-    for (unsigned int i = 0; i != tmpReg.size(); ++i) {
-      DemoteRegToStack(*tmpReg.at(i), F.begin()->getTerminator());
+  }
+  for (unsigned int i = 0; i != tmpReg.size(); ++i) {
+    Instruction *I = tmpReg.at(i);
+    vector<Use *> uses;
+    for (Use &U : I->uses()) {
+      Instruction *UI = cast<Instruction>(U.getUser());
+      if (UI->getParent() != I->getParent() || isa<PHINode>(UI)) {
+        uses.push_back(&U);
+      }
     }
-
-    for (unsigned int i = 0; i != tmpPhi.size(); ++i) {
-      DemotePHIToStack(tmpPhi.at(i), F.begin()->getTerminator());
+    SSAUpdater SSA;
+    SSA.Initialize(I->getType(), I->getName());
+    SSA.AddAvailableValue(I->getParent(), I);
+    for (unsigned int j = 0; j != uses.size(); ++j) {
+      SSA.RewriteUse(*uses.at(j));
     }
-
-  } while (tmpReg.size() != 0 || tmpPhi.size() != 0);
+  }
 }
 
-bool flatten(Function &F) {
+bool flatten(Function &F, bool keepSSA, bool dense) {
   vector<BasicBlock *> origBB;
   BasicBlock *loopEntry;
   BasicBlock *loopEnd;
@@ -97,8 +123,7 @@ bool flatten(Function &F) {
   AllocaInst *switchVar;
 
   // SCRAMBLER
-  char scrambling_key[16];
-  llvm::cryptoutils->get_bytes(scrambling_key, 16);
+  ScrambleKey scrambling_key;
   // END OF SCRAMBLER
 
   // Save all original BB
@@ -146,6 +171,8 @@ bool flatten(Function &F) {
   // Remove jump
   insert->getTerminator()->eraseFromParent();
 
+  llvm::cryptoutils->scramble_key(scrambling_key, dense ? origBB.size() : 0);
+
   Type *I32Ty = Type::getInt32Ty(F.getContext());
   // Create switch variable and set as it
   switchVar = new AllocaInst(I32Ty, 0, "switchVar", insert);
@@ -268,7 +295,11 @@ bool flatten(Function &F) {
     }
   }
 
-  fixStack(F);
+  if (keepSSA) {
+    rebuildSSA(origBB, loopEntry);
+  } else {
+    DemotedSlots += fixStack(F);
+  }
 
   return true;
 }
@@ -276,13 +307,15 @@ bool flatten(Function &F) {
 
 PreservedAnalyses FlatteningPass::run(Function &F,
                                       FunctionAnalysisManager &AM) {
-  if (toObfuscate(Flattening, &F, "fla")) {
+  if (toObfuscate(Flattening, &F, "fla", AM)) {
+    CryptoStream CS(F.getName(), "fla");
 
     // Lower switch
     LowerSwitchPass lower;
     lower.run(F, AM);
 
-    if (flatten(F)) {
+    if (flatten(F, toObfuscate(FlatteningSSA, &F, "fla_ssa", AM),
+                toObfuscate(FlatteningDense, &F, "fla_dense", AM))) {
       ++Flattened;
     }
     return PreservedAnalyses::none();
@@ -2,6 +2,7 @@
 #include "Flattening.h"
 #include "SplitBasicBlock.h"
 #include "Substitution.h"
+#include "Utils.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 
@@ -11,6 +12,12 @@ llvm::PassPluginLibraryInfo getObfuscationPluginInfo() {
   return {
       LLVM_PLUGIN_API_VERSION, "Goron", LLVM_VERSION_STRING,
       [](PassBuilder &PB) {
+        PB.registerAnalysisRegistrationCallback([](ModuleAnalysisManager &MAM) {
+          MAM.registerPass([] { return AnnotationAnalysis(); });
+        });
+        // At module level the annotations are parsed once before the
+        // function passes that query them; at function level each query
+        // parses them itself
         PB.registerPipelineParsingCallback([](StringRef Name, FunctionPassManager &FPM,
                                               ArrayRef<PassBuilder::PipelineElement>) {
           if (Name == "obfs") {
@@ -21,8 +28,22 @@ llvm::PassPluginLibraryInfo getObfuscationPluginInfo() {
           }
           return false;
         });
+        PB.registerPipelineParsingCallback([](StringRef Name, ModulePassManager &MPM,
+                                              ArrayRef<PassBuilder::PipelineElement>) {
+          if (Name == "obfs") {
+            FunctionPassManager FPM;
+            FPM.addPass(SplitBasicBlockPass());
+            FPM.addPass(BogusControlFlowPass());
+            FPM.addPass(FlatteningPass());
+            MPM.addPass(RequireAnalysisPass<AnnotationAnalysis, Module>());
+            MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+            return true;
+          }
+          return false;
+        });
         PB.registerOptimizerLastEPCallback([](llvm::ModulePassManager &MPM,
                                               OptimizationLevel Level) {
+            MPM.addPass(RequireAnalysisPass<AnnotationAnalysis, Module>());
             MPM.addPass(createModuleToFunctionPassAdaptor(SubstitutionPass()));
         });
       }};
@@ -121,7 +121,8 @@ PreservedAnalyses SplitBasicBlockPass::run(Function &F,
   }
 
   // Do we obfuscate
-  if (toObfuscate(SplitEnabled, &F, "split")) {
+  if (toObfuscate(SplitEnabled, &F, "split", AM)) {
+    CryptoStream CS(F.getName(), "split");
     doSplit(F);
     ++Split;
     return PreservedAnalyses::none();
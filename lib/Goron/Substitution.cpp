@@ -552,7 +552,8 @@ PreservedAnalyses SubstitutionPass::run(Function &F,
   }
 
   // Do we obfuscate
-  if (toObfuscate(Substitution, &F, "sub")) {
+  if (toObfuscate(Substitution, &F, "sub", AM)) {
+    CryptoStream CS(F.getName(), "sub");
     substitute(&F);
     return PreservedAnalyses::none();
   }
@@ -1,4 +1,5 @@
 #include "Utils.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
@@ -9,51 +10,79 @@
 
 using namespace llvm;
 
-std::string readAnnotate(Function *f) {
-  std::string annotation = "";
+AnalysisKey AnnotationAnalysis::Key;
+
+AnnotationInfo AnnotationAnalysis::run(Module &M, ModuleAnalysisManager &) {
+  return parse(M);
+}
+
+AnnotationInfo AnnotationAnalysis::parse(Module &M, const Function *Only) {
+  AnnotationInfo Info;
 
   // Get annotation variable
-  GlobalVariable *glob =
-      f->getParent()->getGlobalVariable("llvm.global.annotations");
-
-  if (glob != NULL) {
-    // Get the array
-    if (ConstantArray *ca = dyn_cast<ConstantArray>(glob->getInitializer())) {
-      for (unsigned i = 0; i < ca->getNumOperands(); ++i) {
-        // Get the struct
-        if (ConstantStruct *structAn =
-                dyn_cast<ConstantStruct>(ca->getOperand(i))) {
-          if (ConstantExpr *expr =
-                  dyn_cast<ConstantExpr>(structAn->getOperand(0))) {
-            // If it's a bitcast we can check if the annotation is concerning
-            // the current function
-            if (expr->getOpcode() == Instruction::BitCast &&
-                expr->getOperand(0) == f) {
-              ConstantExpr *note = cast<ConstantExpr>(structAn->getOperand(1));
-              // If it's a GetElementPtr, that means we found the variable
-              // containing the annotations
-              if (note->getOpcode() == Instruction::GetElementPtr) {
-                if (GlobalVariable *annoteStr =
-                        dyn_cast<GlobalVariable>(note->getOperand(0))) {
-                  if (ConstantDataSequential *data =
-                          dyn_cast<ConstantDataSequential>(
-                              annoteStr->getInitializer())) {
-                    if (data->isString()) {
-                      annotation += data->getAsString().lower() + " ";
-                    }
-                  }
-                }
-              }
-            }
-          }
+  GlobalVariable *glob = M.getGlobalVariable("llvm.global.annotations");
+  if (glob == NULL || !glob->hasInitializer()) {
+    return Info;
+  }
+  Info.Source = glob->getInitializer();
+
+  // Get the array
+  ConstantArray *ca = dyn_cast<ConstantArray>(glob->getInitializer());
+  if (ca == NULL) {
+    return Info;
+  }
+  for (unsigned i = 0; i < ca->getNumOperands(); ++i) {
+    // Get the struct
+    ConstantStruct *structAn = dyn_cast<ConstantStruct>(ca->getOperand(i));
+    if (structAn == NULL) {
+      continue;
+    }
+    // The annotated value is a bitcast of the function with typed pointers,
+    // and the function itself with opaque ones
+    Function *fn =
+        dyn_cast<Function>(structAn->getOperand(0)->stripPointerCasts());
+    GlobalVariable *annoteStr =
+        dyn_cast<GlobalVariable>(structAn->getOperand(1)->stripPointerCasts());
+    if (fn == NULL || (Only != NULL && fn != Only) || annoteStr == NULL ||
+        !annoteStr->hasInitializer()) {
+      continue;
+    }
+    ConstantDataSequential *data =
+        dyn_cast<ConstantDataSequential>(annoteStr->getInitializer());
+    if (data == NULL || !data->isString()) {
+      continue;
+    }
+
+    StringSet<> &words = Info.Words[fn];
+    std::string note = data->getAsString().lower();
+    size_t start = 0;
+    for (size_t j = 0; j <= note.size(); j++) {
+      if (j == note.size() || !(isAlnum(note[j]) || note[j] == '_')) {
+        if (j > start) {
+          words.insert(StringRef(note).slice(start, j));
         }
+        start = j + 1;
       }
     }
   }
-  return annotation;
+  return Info;
 }
 
-bool toObfuscate(bool flag, Function *f, std::string attribute) {
+bool AnnotationInfo::hasAnnotation(const Function *F, StringRef Word) const {
+  auto it = Words.find(F);
+  return it != Words.end() && it->second.count(Word);
+}
+
+bool AnnotationInfo::invalidate(Module &M, const PreservedAnalyses &,
+                                ModuleAnalysisManager::Invalidator &) {
+  GlobalVariable *glob = M.getGlobalVariable("llvm.global.annotations");
+  const Constant *init =
+      glob != NULL && glob->hasInitializer() ? glob->getInitializer() : NULL;
+  return init != Source;
+}
+
+bool toObfuscate(bool flag, Function *f, std::string attribute,
+                 FunctionAnalysisManager &AM) {
   std::string attr = attribute;
   std::string attrNo = "no" + attr;
 
@@ -67,15 +96,26 @@ bool toObfuscate(bool flag, Function *f, std::string attribute) {
     return false;
   }
 
+  // The annotations are parsed once per module by AnnotationAnalysis, which
+  // the plugin schedules ahead of its module-level pipelines. A function
+  // pipeline cannot run a module analysis, so there only the annotations of
+  // f are read, in one scan like the old readAnnotate.
+  const AnnotationInfo *Notes =
+      AM.getResult<ModuleAnalysisManagerFunctionProxy>(*f)
+          .getCachedResult<AnnotationAnalysis>(*f->getParent());
+  AnnotationInfo Parsed;
+  if (!Notes) {
+    Parsed = AnnotationAnalysis::parse(*f->getParent(), f);
+    Notes = &Parsed;
+  }
+
   // We have to check the nofla flag first
-  // Because .find("fla") is true for a string like "fla" or
-  // "nofla"
-  if (readAnnotate(f).find(attrNo) != std::string::npos) {
+  if (Notes->hasAnnotation(f, attrNo)) {
     return false;
   }
 
   // If fla annotations
-  if (readAnnotate(f).find(attr) != std::string::npos) {
+  if (Notes->hasAnnotation(f, attr)) {
     return true;
   }
 
@@ -101,3 +141,69 @@ bool toObfuscate(bool flag, Function *f, std::string attribute) {
 
   return false;
 }
+
+// Shamefully borrowed from ../Scalar/RegToMem.cpp :(
+bool valueEscapes(const Instruction &Inst) {
+  if (!Inst.getType()->isSized())
+    return false;
+
+  const BasicBlock *BB = Inst.getParent();
+  for (const User *U : Inst.users()) {
+    const Instruction *UI = cast<Instruction>(U);
+    if (UI->getParent() != BB || isa<PHINode>(UI))
+      return true;
+  }
+  return false;
+}
+
+// Demote every value and PHI that lives across blocks to the stack in a
+// single scan. Demoting only adds loads and stores next to their users, so
+// the one new cross-block value it can create, the reload of an escaping
+// PHI, is demoted straight away rather than by rescanning the function.
+// Returns the number of stack slots created.
+unsigned fixStack(Function &F) {
+  std::vector<PHINode *> tmpPhi;
+  std::vector<Instruction *> tmpReg;
+  std::vector<AllocaInst *> escapedPhi;
+  BasicBlock *bbEntry = &*F.begin();
+  Instruction *allocaPoint = &*bbEntry->getFirstInsertionPt();
+  while (isa<AllocaInst>(allocaPoint)) {
+    allocaPoint = allocaPoint->getNextNode();
+  }
+
+  for (Function::iterator i = F.begin(); i != F.end(); ++i) {
+    for (BasicBlock::iterator j = i->begin(); j != i->end(); ++j) {
+      if (isa<PHINode>(j)) {
+        tmpPhi.push_back(cast<PHINode>(j));
+        continue;
+      }
+      if (!(isa<AllocaInst>(j) && j->getParent() == bbEntry) &&
+          valueEscapes(*j)) {
+        tmpReg.push_back(&*j);
+      }
+    }
+  }
+
+  for (unsigned int i = 0; i != tmpReg.size(); ++i) {
+    DemoteRegToStack(*tmpReg.at(i), false, allocaPoint);
+  }
+  for (unsigned int i = 0; i != tmpPhi.size(); ++i) {
+    bool escapes = valueEscapes(*tmpPhi.at(i));
+    AllocaInst *slot = DemotePHIToStack(tmpPhi.at(i), allocaPoint);
+    if (escapes) {
+      escapedPhi.push_back(slot);
+    }
+  }
+
+  unsigned slots = tmpReg.size() + tmpPhi.size();
+  for (unsigned int i = 0; i != escapedPhi.size(); ++i) {
+    for (User *U : escapedPhi.at(i)->users()) {
+      if (LoadInst *LI = dyn_cast<LoadInst>(U)) {
+        DemoteRegToStack(*LI, false, allocaPoint);
+        slots++;
+        break;
+      }
+    }
+  }
+  return slots;
+}
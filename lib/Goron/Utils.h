@@ -1,9 +1,42 @@
 #ifndef LLVM_OBFUSCATION_UTILS_H
 #define LLVM_OBFUSCATION_UTILS_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
 
-std::string readAnnotate(llvm::Function *f);
-bool toObfuscate(bool flag, llvm::Function *f, std::string attribute);
+namespace llvm {
+// Annotation words of every function in llvm.global.annotations, lowercased
+// and split on anything that is not an identifier character.
+class AnnotationInfo {
+public:
+  bool hasAnnotation(const Function *F, StringRef Word) const;
+  // Only stale once the annotations global itself has been rewritten
+  bool invalidate(Module &M, const PreservedAnalyses &PA,
+                  ModuleAnalysisManager::Invalidator &Inv);
+
+private:
+  friend class AnnotationAnalysis;
+  const Constant *Source = nullptr;
+  DenseMap<const Function *, StringSet<>> Words;
+};
+
+class AnnotationAnalysis : public AnalysisInfoMixin<AnnotationAnalysis> {
+  friend AnalysisInfoMixin<AnnotationAnalysis>;
+  static AnalysisKey Key;
+
+public:
+  using Result = AnnotationInfo;
+  Result run(Module &M, ModuleAnalysisManager &MAM);
+  // Only the annotations of Only, when given
+  static AnnotationInfo parse(Module &M, const Function *Only = nullptr);
+};
+} // namespace llvm
+
+bool toObfuscate(bool flag, llvm::Function *f, std::string attribute,
+                 llvm::FunctionAnalysisManager &AM);
+bool valueEscapes(const llvm::Instruction &Inst);
+unsigned fixStack(llvm::Function &F);
 
 #endif
@@ -240,6 +240,7 @@ struct BogusControlFlow : public FunctionPass {
     if (toObfuscate(flag, &F, "bcf") && !F.isPresplitCoroutine() &&
         !readAnnotationMetadata(&F, "bcfopfunc")) {
       errs() << "Running BogusControlFlow On " << F.getName() << "\n";
+      CryptoStream CS(F.getName(), "bcf");
       bogus(F);
       doF(F);
     }
@@ -104,6 +104,7 @@ struct ConstantEncryption : public ModulePass {
     for (Function &F : M)
       if (toObfuscate(flag, &F, "constenc") && !F.isPresplitCoroutine()) {
         errs() << "Running ConstantEncryption On " << F.getName() << "\n";
+        CryptoStream CS(F.getName(), "constenc");
         FixFunctionConstantExpr(&F);
         if (!toObfuscateUint32Option(&F, "constenc_prob", &ObfProbRateTemp))
           ObfProbRateTemp = ObfProbRate;
@@ -17,15 +17,25 @@
 #ifndef _CRYPTO_UTILS_H_
 #define _CRYPTO_UTILS_H_
 
+#include "llvm/ADT/StringRef.h"
 #include "llvm/Support/ManagedStatic.h"
 #include <cstdio>
 #include <map>
-#include <random>
 #include <stdint.h>
 #include <string>
 
 namespace llvm {
 
+// Key of the permutation computed by CryptoUtils::scramble32. Range == 0
+// permutes the whole 32-bit space; otherwise [0, Range) is mapped onto the
+// dense window [Base, Base + Range).
+struct ScrambleKey {
+  uint32_t Round[4];
+  uint32_t Range;
+  uint32_t Base;
+  uint32_t HalfBits;
+};
+
 class CryptoUtils {
 public:
   CryptoUtils();
@@ -43,21 +53,46 @@ public:
   uint64_t get_uint64_t() { return get<uint64_t>(); };
   uint32_t get_uint8_t() { return get<uint8_t>(); };
   uint32_t get_uint16_t() { return get<uint16_t>(); };
+  // Fill Len bytes / N elements at once instead of one draw per call
+  void get_bytes(uint8_t *Buf, size_t Len);
+  template <typename T> void fill(T *Buf, size_t N) {
+    get_bytes(reinterpret_cast<uint8_t *>(Buf), N * sizeof(T));
+  }
 
   // Scramble32 originally uses AES to generates the mapping relationship
-  // between a BB and its switchvar Hikari updates this by doing this using
-  // mt19937_64 in C++ STLs which is a faster but less cryprographically secured
-  // This method try to find the corresponding value from the VMap first, if not
-  // then use RNG to generate,fill and return the value
-  uint32_t scramble32(uint32_t in,
-                      std::map<uint32_t /*IDX*/, uint32_t /*VAL*/> &VMap);
+  // between a BB and its switchvar. Hikari used to draw a fresh random value
+  // per index and remember it in a map, which could hand out the same value
+  // twice. It is now a keyed 4-round Feistel network: a bijection computed in
+  // O(1) per index, so distinct indices always get distinct values.
+  // With a non-zero Range the network runs on the smallest even bit width
+  // covering Range and cycle-walks back into [0, Range), which keeps the
+  // values contiguous enough for the switch to be lowered as a jump table.
+  void scramble_key(ScrambleKey &Key, uint32_t Range = 0);
+  uint32_t scramble32(uint32_t in, const ScrambleKey &Key);
 
 private:
-  std::mt19937_64 *eng = nullptr;
+  std::uint_fast64_t seed = 0;
+  bool seeded = false;
   std::uint_fast64_t get_raw();
+  friend class CryptoStream;
 };
 extern ManagedStatic<CryptoUtils> cryptoutils;
 
+// The generator is counter-based: every thread draws from its own stream,
+// identified by a key and a position. By default that is the module stream
+// derived from the seed alone. A CryptoStream switches the calling thread to
+// the stream keyed by (seed, Name, PassID) until it goes out of scope, so what
+// a pass emits for one function does not depend on how many values were drawn
+// for any other function, or on which thread or in which order they ran.
+class CryptoStream {
+public:
+  CryptoStream(StringRef Name, StringRef PassID);
+  ~CryptoStream();
+
+private:
+  std::uint_fast64_t SavedKey, SavedCtr;
+};
+
 } // namespace llvm
 
 #endif
@@ -2,15 +2,42 @@
 // [License](https://github.com/HikariObfuscator/Hikari/wiki/License).
 //===----------------------------------------------------------------------===//
 #include "Flattening.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/NoFolder.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
 #include "CryptoUtils.h"
 #include "Utils.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/LowerSwitch.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 
 using namespace llvm;
 
+static cl::opt<bool>
+    KeepSSA("fla_ssa", cl::init(false), cl::NotHidden,
+            cl::desc("Rebuild SSA values through the dispatcher instead of "
+                     "demoting them to the stack when flattening"));
+static bool KeepSSATemp = false;
+
+static cl::opt<bool> ThreadedDispatch(
+    "fla_threaded", cl::init(false), cl::NotHidden,
+    cl::desc("Dispatch each flattened block through its own indirectbr "
+             "instead of a shared switch"));
+static bool ThreadedDispatchTemp = false;
+
+static cl::opt<bool>
+    DenseCases("fla_dense", cl::init(false), cl::NotHidden,
+               cl::desc("Keep dispatcher case values contiguous so the "
+                        "switch can be lowered as a jump table"));
+static bool DenseCasesTemp = false;
+
 namespace {
 struct Flattening : public FunctionPass {
   static char ID; // Pass identification, replacement for typeid
@@ -19,6 +46,10 @@ struct Flattening : public FunctionPass {
   Flattening(bool flag) : FunctionPass(ID) { this->flag = flag; }
   bool runOnFunction(Function &F) override;
   void flatten(Function *f);
+  void fixDominance(Function *f, SmallVectorImpl<BasicBlock *> &origBB);
+  void rebuildSSA(SmallVectorImpl<BasicBlock *> &origBB);
+  void threadDispatch(Function *f, BasicBlock *insert,
+                      SmallVectorImpl<BasicBlock *> &origBB);
 };
 } // namespace
 
@@ -33,6 +64,13 @@ bool Flattening::runOnFunction(Function &F) {
   // Do we obfuscate
   if (toObfuscate(flag, tmp, "fla") && !F.isPresplitCoroutine()) {
     errs() << "Running ControlFlowFlattening On " << F.getName() << "\n";
+    CryptoStream CS(F.getName(), "fla");
+    if (!toObfuscateBoolOption(tmp, "fla_ssa", &KeepSSATemp))
+      KeepSSATemp = KeepSSA;
+    if (!toObfuscateBoolOption(tmp, "fla_threaded", &ThreadedDispatchTemp))
+      ThreadedDispatchTemp = ThreadedDispatch;
+    if (!toObfuscateBoolOption(tmp, "fla_dense", &DenseCasesTemp))
+      DenseCasesTemp = DenseCases;
     flatten(tmp);
   }
 
@@ -48,7 +86,7 @@ void Flattening::flatten(Function *f) {
   const DataLayout &DL = f->getParent()->getDataLayout();
 
   // SCRAMBLER
-  std::map<uint32_t, uint32_t> scrambling_key;
+  ScrambleKey scrambling_key;
   // END OF SCRAMBLER
 
   PassBuilder PB;
@@ -100,6 +138,12 @@ void Flattening::flatten(Function *f) {
     origBB.insert(origBB.begin(), tmpBB);
   }
 
+  if (ThreadedDispatchTemp) {
+    threadDispatch(f, insert, origBB);
+    fixDominance(f, origBB);
+    return;
+  }
+
   // Remove jump
   Instruction *oldTerm = insert->getTerminator();
 
@@ -112,6 +156,8 @@ void Flattening::flatten(Function *f) {
   // Remove jump
   oldTerm->eraseFromParent();
 
+  cryptoutils->scramble_key(scrambling_key,
+                            DenseCasesTemp ? origBB.size() : 0);
   new StoreInst(ConstantInt::get(Type::getInt32Ty(f->getContext()),
                                  cryptoutils->scramble32(0, scrambling_key)),
                 switchVar, insert);
@@ -228,7 +274,155 @@ void Flattening::flatten(Function *f) {
       continue;
     }
   }
+  fixDominance(f, origBB);
+}
+
+// Original blocks are now only reachable through the dispatcher, so values
+// no longer dominate their uses in other blocks and PHIs have lost the edges
+// they select on.
+void Flattening::fixDominance(Function *f,
+                              SmallVectorImpl<BasicBlock *> &origBB) {
+  if (KeepSSATemp) {
+    rebuildSSA(origBB);
+    return;
+  }
   errs() << "Fixing Stack\n";
-  fixStack(f);
-  errs() << "Fixed Stack\n";
+  unsigned slots = fixStack(f);
+  errs() << "Fixed Stack With " << slots << " Slots\n";
+}
+
+// Instead of spilling everything, let SSAUpdater carry values around the
+// dispatcher with PHIs in the dispatching blocks:
+//  - the operands of a PHI in B become a variable defined at the end of each
+//    incoming block, since the last original block run before B is always
+//    one of them. The PHI itself is kept, now reading that variable out of
+//    each of B's new predecessors, so its own value is not clobbered when an
+//    incoming block runs again before a later use.
+//  - a value used outside its block becomes a variable defined in its own
+//    block. It dominated its uses before flattening, so the copy carried to a
+//    use is always the latest definition.
+// The entry block still dominates everything and is left alone.
+void Flattening::rebuildSSA(SmallVectorImpl<BasicBlock *> &origBB) {
+  SmallVector<PHINode *, 8> tmpPhi;
+  SmallVector<PHINode *, 8> newPhi;
+  for (BasicBlock *BB : origBB)
+    for (PHINode &PN : BB->phis())
+      tmpPhi.emplace_back(&PN);
+
+  // SSAUpdater reads predecessor lists off existing PHIs, so swap the stale
+  // ones for well-formed placeholders before asking it anything.
+  for (PHINode *PN : tmpPhi) {
+    PHINode *NewPN = PHINode::Create(PN->getType(), 1, PN->getName(), PN);
+    for (BasicBlock *Pred : predecessors(PN->getParent()))
+      NewPN->addIncoming(UndefValue::get(PN->getType()), Pred);
+    PN->replaceAllUsesWith(NewPN);
+    PN->removeFromParent();
+    newPhi.emplace_back(NewPN);
+  }
+  for (unsigned j = 0; j < tmpPhi.size(); ++j) {
+    PHINode *PN = tmpPhi[j];
+    SSAUpdater SSA;
+    SSA.Initialize(PN->getType(), PN->getName());
+    for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; ++i)
+      SSA.AddAvailableValue(PN->getIncomingBlock(i), PN->getIncomingValue(i));
+    for (unsigned i = 0, e = newPhi[j]->getNumIncomingValues(); i != e; ++i)
+      newPhi[j]->setIncomingValue(
+          i, SSA.GetValueAtEndOfBlock(newPhi[j]->getIncomingBlock(i)));
+  }
+  for (PHINode *PN : tmpPhi)
+    PN->dropAllReferences();
+  for (PHINode *PN : tmpPhi)
+    PN->deleteValue();
+
+  SmallVector<Instruction *, 32> tmpReg;
+  for (BasicBlock *BB : origBB)
+    for (Instruction &I : *BB)
+      for (User *U : I.users()) {
+        Instruction *UI = cast<Instruction>(U);
+        if (UI->getParent() != BB || isa<PHINode>(UI)) {
+          tmpReg.emplace_back(&I);
+          break;
+        }
+      }
+  for (Instruction *I : tmpReg) {
+    SmallVector<Use *, 8> Uses;
+    for (Use &U : I->uses()) {
+      Instruction *UI = cast<Instruction>(U.getUser());
+      if (UI->getParent() != I->getParent() || isa<PHINode>(UI))
+        Uses.emplace_back(&U);
+    }
+    SSAUpdater SSA;
+    SSA.Initialize(I->getType(), I->getName());
+    SSA.AddAvailableValue(I->getParent(), I);
+    for (Use *U : Uses)
+      SSA.RewriteUse(*U);
+  }
+}
+
+// Direct-threaded backend: instead of funnelling every block through the
+// shared switch in loopEntry, each block selects its successor's state and
+// jumps through its own load of a per-function blockaddress table, so the
+// branch predictor sees one site per block rather than one for the whole
+// function. States are the dense scrambled case values of the switch backend
+// and the table is laid out in that permuted order, indexed by the state less
+// the key's base. The table is a writable global kept alive through
+// llvm.compiler.used so the loads cannot be folded back into direct branches.
+// Listing every case block on every indirectbr would add N^2 edges for
+// fixStack or rebuildSSA to repair, so each one lists the block's successors
+// and at most ThreadedDecoys other case blocks; the decoy edges still break
+// the original dominance, which is fixed up like the switch.
+void Flattening::threadDispatch(Function *f, BasicBlock *insert,
+                                SmallVectorImpl<BasicBlock *> &origBB) {
+  static const unsigned ThreadedDecoys = 2;
+  Module *M = f->getParent();
+  Type *Int32Ty = Type::getInt32Ty(f->getContext());
+  Type *Int8PtrTy = Type::getInt8PtrTy(f->getContext());
+
+  ScrambleKey scrambling_key;
+  cryptoutils->scramble_key(scrambling_key, origBB.size());
+  DenseMap<BasicBlock *, Constant *> stateOf;
+  SmallVector<Constant *, 8> BlockAddresses(origBB.size());
+  for (unsigned i = 0; i < origBB.size(); i++) {
+    uint32_t state = cryptoutils->scramble32(i, scrambling_key);
+    stateOf[origBB[i]] = ConstantInt::get(Int32Ty, state);
+    BlockAddresses[state - scrambling_key.Base] = BlockAddress::get(origBB[i]);
+  }
+  ArrayType *AT = ArrayType::get(Int8PtrTy, BlockAddresses.size());
+  GlobalVariable *Table = new GlobalVariable(
+      *M, AT, false, GlobalValue::LinkageTypes::PrivateLinkage,
+      ConstantArray::get(AT, BlockAddresses), "FlatteningDispatchTable");
+  appendToCompilerUsed(*M, {Table});
+
+  SmallVector<BranchInst *, 8> BIs;
+  if (BranchInst *BI = dyn_cast<BranchInst>(insert->getTerminator()))
+    BIs.emplace_back(BI);
+  for (BasicBlock *BB : origBB)
+    if (BranchInst *BI = dyn_cast<BranchInst>(BB->getTerminator()))
+      BIs.emplace_back(BI);
+
+  for (BranchInst *BI : BIs) {
+    IRBuilder<NoFolder> IRB(BI);
+    Value *state = stateOf[BI->getSuccessor(0)];
+    if (BI->isConditional())
+      state = IRB.CreateSelect(BI->getCondition(), state,
+                               stateOf[BI->getSuccessor(1)], "switchVar");
+    Value *index = IRB.CreateSub(
+        state, ConstantInt::get(Int32Ty, scrambling_key.Base));
+    Value *GEP =
+        IRB.CreateGEP(AT, Table, {ConstantInt::get(Int32Ty, 0), index});
+    Value *Target = IRB.CreateLoad(Int8PtrTy, GEP, "FlatteningDispatchTarget");
+
+    SmallSetVector<BasicBlock *, 4> Dests;
+    for (BasicBlock *Succ : successors(BI))
+      Dests.insert(Succ);
+    unsigned decoys = std::min<size_t>(ThreadedDecoys,
+                                       origBB.size() - Dests.size());
+    for (unsigned tries = 0; decoys && tries < 4 * ThreadedDecoys; tries++)
+      if (Dests.insert(origBB[cryptoutils->get_range(origBB.size())]))
+        decoys--;
+    IndirectBrInst *indirBr = IndirectBrInst::Create(Target, Dests.size());
+    for (BasicBlock *Dest : Dests)
+      indirBr->addDestination(Dest);
+    ReplaceInstWithInst(BI, indirBr);
+  }
 }
@@ -68,10 +68,12 @@ struct IndirectBranch : public FunctionPass {
                                  &EncryptJumpTargetTemp))
         EncryptJumpTargetTemp = EncryptJumpTarget;
 
-      if (EncryptJumpTargetTemp)
+      if (EncryptJumpTargetTemp) {
+        CryptoStream CS(F.getName(), "indibr_enc_jump_target");
         encmap[&F] = ConstantInt::get(
             Type::getInt32Ty(M.getContext()),
             cryptoutils->get_range(UINT8_MAX, UINT16_MAX * 2) * 4);
+      }
       for (BasicBlock &BB : F)
         if (!BB.isEntryBlock()) {
           indexmap[&BB] = i++;
@@ -103,6 +105,7 @@ struct IndirectBranch : public FunctionPass {
     if (!this->initialized)
       initialize(*M);
     errs() << "Running IndirectBranch On " << Func.getName() << "\n";
+    CryptoStream CS(Func.getName(), "indibr");
     SmallVector<BranchInst *, 32> BIs;
     for (Instruction &Inst : instructions(Func))
       if (BranchInst *BI = dyn_cast<BranchInst>(&Inst))
@@ -35,6 +35,7 @@ struct SplitBasicBlock : public FunctionPass {
     // Do we obfuscate
     if (toObfuscate(flag, &F, "split")) {
       errs() << "Running BasicBlockSplit On " << F.getName() << "\n";
+      CryptoStream CS(F.getName(), "split");
       split(&F);
     }
 
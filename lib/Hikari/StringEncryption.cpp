@@ -2,12 +2,26 @@
 // [License](https://github.com/HikariObfuscator/Hikari/wiki/License).
 //===----------------------------------------------------------------------===//
 #include "StringEncryption.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#if LLVM_VERSION_MAJOR >= 17
+#include "llvm/TargetParser/Triple.h"
+#else
+#include "llvm/ADT/Triple.h"
+#endif
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/NoFolder.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/SwapByteOrder.h"
 #include "CryptoUtils.h"
 #include "Obfuscation.h"
 #include "Utils.h"
@@ -22,17 +36,137 @@ static cl::opt<uint32_t>
                                 "obfuscated by the -strcry pass"));
 static uint32_t ElementEncryptProbTemp = 100;
 
+static cl::opt<uint32_t> DecryptUnrollLimit(
+    "strcry_unroll_limit", cl::init(16), cl::NotHidden,
+    cl::desc("Strings with more elements than this are decrypted by a loop "
+             "instead of element-by-element by the -strcry pass"));
+static uint32_t DecryptUnrollLimitTemp = 16;
+
+static cl::opt<bool> DecryptHelper(
+    "strcry_helper", cl::init(false), cl::NotHidden,
+    cl::desc("Decrypt fully encrypted strings by calling a vectorized "
+             "helper shared across the module in the -strcry pass"));
+static bool DecryptHelperTemp = false;
+
+static cl::opt<bool> Keystream(
+    "strcry_keystream", cl::init(false), cl::NotHidden,
+    cl::desc("Derive the keys of each string from a 64-bit seed at runtime "
+             "instead of storing them in the -strcry pass"));
+static bool KeystreamTemp = false;
+
+static cl::opt<bool> InPlace(
+    "strcry_inplace", cl::init(false), cl::NotHidden,
+    cl::desc("Decrypt strings over their encrypted copy instead of into a "
+             "separate DecryptSpace in the -strcry pass"));
+static bool InPlaceTemp = false;
+
+static cl::opt<bool> LazyDecrypt(
+    "strcry_lazy", cl::init(false), cl::NotHidden,
+    cl::desc("Decrypt each string on its own right before its first use "
+             "instead of all of them at function entry in the -strcry pass"));
+static bool LazyDecryptTemp = false;
+
+static cl::opt<bool> CtorDecrypt(
+    "strcry_ctor", cl::init(false), cl::NotHidden,
+    cl::desc("Decrypt the strings of a function once from a module "
+             "constructor instead of checking on every call in the -strcry "
+             "pass"));
+static bool CtorDecryptTemp = false;
+
+// 101 is the first priority available to user code, so strings are already
+// decrypted when the module's regular static initializers run. There is no
+// fallback check in the functions themselves: a constructor of another object
+// file, or one with a priority at or below this one, that calls them early
+// sees the strings still encrypted.
+static cl::opt<uint32_t> CtorDecryptPriority(
+    "strcry_ctor_priority", cl::init(101), cl::NotHidden,
+    cl::desc("Priority of the constructor emitted by -strcry_ctor. Functions "
+             "called before it runs, e.g. from constructors of other object "
+             "files or of lower priority, see their strings encrypted"));
+
+static cl::opt<bool> PoolStrings(
+    "strcry_pool", cl::init(false), cl::NotHidden,
+    cl::desc("Encrypt each string once per module and share its decrypted "
+             "copy between all functions using it in the -strcry pass"));
+
+static cl::opt<bool> ComdatStrings(
+    "strcry_comdat", cl::init(false), cl::NotHidden,
+    cl::desc("Pool strings under names derived from the seed and their "
+             "contents in COMDAT groups, so the linker keeps one copy per "
+             "string across object files built with the same -aesSeed"));
+
+static cl::opt<bool> PageProtect(
+    "strcry_pages", cl::init(false), cl::NotHidden,
+    cl::desc("Keep large strings encrypted in PROT_NONE pages in the -strcry "
+             "pass, each page decrypted on its first access from a SIGSEGV "
+             "handler. Calls to write, send and fwrite in the module first "
+             "decrypt the pages of the buffer they pass; any other system "
+             "call given a protected string fails with EFAULT on pages not "
+             "yet touched. x86_64 Linux only. A SIGSEGV handler installed "
+             "later without chaining to it, e.g. by a sanitizer or crash "
+             "reporter, makes those accesses fault instead"));
+
+static cl::opt<uint32_t> PageProtectMin(
+    "strcry_pages_min", cl::init(4096), cl::NotHidden,
+    cl::desc("Strings of at least this many bytes are protected by "
+             "-strcry_pages"));
+
+// Elements encrypted per batch of random draws
+static const size_t EncryptChunkSize = 4096;
+
+// -strcry_pages constants from the x86_64 Linux ABI
+static const uint64_t ProtectedPageSize = 4096;
+static const int SigSegv = 11;
+static const int SaSigInfo = 0x4, SaRestart = 0x10000000;
+static const int ProtNone = 0x0, ProtReadWrite = 0x3;
+static const int MapPrivateAnonymous = 0x22;
+static const int MRemapMayMoveFixed = 0x3;
+
+// xorshift64 step. The decryption loop emitted by EmitDecryptionLoop
+// computes exactly the same sequence, so keep the two in sync.
+static uint64_t keystreamNext(uint64_t &State) {
+  State ^= State << 13;
+  State ^= State >> 7;
+  State ^= State << 17;
+  return State;
+}
+
 namespace llvm {
 struct StringEncryption : public ModulePass {
   static char ID;
   bool flag;
   bool appleptrauth;
   bool opaquepointers;
+  bool pool;
+  bool comdat;
+  bool pageprotect;
   std::map<Function * /*Function*/, GlobalVariable * /*Decryption Status*/>
       encstatus;
   std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>> mgv2keys;
   std::map<Constant *, SmallVector<unsigned int, 16>> unencryptedindex;
-  SmallVector<GlobalVariable *, 32> genedgv;
+  DenseSet<GlobalVariable *> genedgv;
+  DenseSet<Function *> genedfunc;
+  // -strcry_pool: original string to its (EncryptedString, DecryptSpace),
+  // and DecryptSpace to the function decrypting it exactly once
+  DenseMap<GlobalVariable *, std::pair<GlobalVariable *, GlobalVariable *>>
+      pooled;
+  DenseMap<GlobalVariable *, Function *> pooldecryptor;
+  // -strcry_comdat: group name to the strings already emitted in it
+  StringMap<std::pair<GlobalVariable *, GlobalVariable *>> comdatpooled;
+  Function *decrypthelper;
+  Function *decryptctor;
+  BasicBlock *decryptctorend;
+  BranchInst *decryptctortail;
+  // -strcry_pages: the SIGSEGV handler, the constructor installing it and
+  // the hook run before system calls, each protected string appends blocks
+  // to all three
+  Function *pagehandler;
+  BasicBlock *pagehandlerfallback;
+  BranchInst *pagehandlertail;
+  BranchInst *pageinittail;
+  Function *pagekernel;
+  BranchInst *pagekerneltail;
+  Function *pagedecryptor;
   StringEncryption() : ModulePass(ID) { this->flag = true; }
 
   StringEncryption(bool flag) : ModulePass(ID) { this->flag = flag; }
@@ -44,10 +178,10 @@ struct StringEncryption : public ModulePass {
         !(GV->getSection().contains("__objc") &&
           !GV->getSection().contains("array")) &&
         !GV->getName().contains("OBJC") &&
-        std::find(genedgv.begin(), genedgv.end(), GV) == genedgv.end() &&
+        !genedgv.count(GV) &&
         ((GV->getLinkage() == GlobalValue::LinkageTypes::PrivateLinkage ||
           GV->getLinkage() == GlobalValue::LinkageTypes::InternalLinkage) &&
-         (flag || AreUsersInOneFunction(GV))))
+         (flag || pool || AreUsersInOneFunction(GV))))
       return true;
     return false;
   }
@@ -62,9 +196,36 @@ struct StringEncryption : public ModulePass {
     this->opaquepointers = !M.getContext().supportsTypedPointers();
 #endif
 
+    // Without COMDAT support strings are still pooled, just within the module
+    this->comdat =
+        ComdatStrings && Triple(M.getTargetTriple()).supportsCOMDAT();
+    this->pool = PoolStrings || ComdatStrings;
+    Triple T(M.getTargetTriple());
+    this->pageprotect = T.getArch() == Triple::x86_64 && T.isOSLinux() &&
+                        T.isOSBinFormatELF();
+
+    this->decrypthelper = nullptr;
+    this->decryptctor = nullptr;
+    this->pagehandler = nullptr;
+    this->pagekernel = nullptr;
+    this->pagedecryptor = nullptr;
+    pooled.clear();
+    pooldecryptor.clear();
+    comdatpooled.clear();
+
+    // Protected strings replace their globals, so they have to be done
+    // before any function starts collecting users
+    if (PageProtect && pageprotect)
+      for (GlobalVariable &GV : make_early_inc_range(M.globals()))
+        if (handleableGV(&GV) && isUsedByObfuscated(&GV))
+          HandlePageProtection(&GV);
+    if (pagekernel)
+      HookKernelBuffers(M);
+
     for (Function &F : M)
-      if (toObfuscate(flag, &F, "strenc")) {
+      if (!genedfunc.count(&F) && toObfuscate(flag, &F, "strenc")) {
         errs() << "Running StringEncryption On " << F.getName() << "\n";
+        CryptoStream CS(F.getName(), "strenc");
 
         if (!toObfuscateUint32Option(&F, "strcry_prob",
                                      &ElementEncryptProbTemp))
@@ -77,21 +238,125 @@ struct StringEncryption : public ModulePass {
                     "-strcry_prob=x must be 0 < x <= 100";
           return false;
         }
-        Constant *S =
-            ConstantInt::getNullValue(Type::getInt32Ty(M.getContext()));
-        GlobalVariable *GV = new GlobalVariable(
-            M, S->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
-            S, "StringEncryptionEncStatus");
-        encstatus[&F] = GV;
+        if (!toObfuscateUint32Option(&F, "strcry_unroll_limit",
+                                     &DecryptUnrollLimitTemp))
+          DecryptUnrollLimitTemp = DecryptUnrollLimit;
+        if (!toObfuscateBoolOption(&F, "strcry_helper", &DecryptHelperTemp))
+          DecryptHelperTemp = DecryptHelper;
+        if (!toObfuscateBoolOption(&F, "strcry_keystream", &KeystreamTemp))
+          KeystreamTemp = Keystream;
+        if (!toObfuscateBoolOption(&F, "strcry_inplace", &InPlaceTemp))
+          InPlaceTemp = InPlace;
+        if (!toObfuscateBoolOption(&F, "strcry_lazy", &LazyDecryptTemp))
+          LazyDecryptTemp = LazyDecrypt;
+        if (!toObfuscateBoolOption(&F, "strcry_ctor", &CtorDecryptTemp))
+          CtorDecryptTemp = CtorDecrypt;
+        if (!CtorDecryptTemp) {
+          Constant *S =
+              ConstantInt::getNullValue(Type::getInt32Ty(M.getContext()));
+          GlobalVariable *GV = new GlobalVariable(
+              M, S->getType(), false,
+              GlobalValue::LinkageTypes::PrivateLinkage, S,
+              "StringEncryptionEncStatus");
+          encstatus[&F] = GV;
+        }
         HandleFunction(&F);
       }
     return true;
   }
 
+  // Encrypt the Width byte elements in Raw in chunks of EncryptChunkSize,
+  // drawing the keys and the per-element probabilities for a whole chunk at
+  // once, straight into the buffers the initializers are created from. Only
+  // the buffers the mode needs are filled: Keys is left empty with
+  // KeystreamTemp, as the keys come from State. Encrypted receives
+  // EncryptedString, which unless DecryptInPlace only holds the elements
+  // that got encrypted. When decrypting into a copy, Dummy receives the
+  // DecryptSpace initializer, the skipped elements as is and zero elsewhere,
+  // and stays empty when nothing was skipped. Elements are XORed byte by
+  // byte, which is the same thing at any width.
+  void encryptElements(StringRef Raw, unsigned Width, bool DecryptInPlace,
+                       uint64_t &State, SmallVectorImpl<unsigned> &Skipped,
+                       std::string &Keys, std::string &Encrypted,
+                       std::string &Dummy) {
+    assert(isPowerOf2_32(Width) && Width <= 8 && "Unsupported CDS Type");
+    const size_t NumElements = Raw.size() / Width;
+    const bool AllEncrypted = ElementEncryptProbTemp >= 100;
+    if (!KeystreamTemp)
+      Keys.resize(Raw.size());
+    Encrypted.resize(Raw.size());
+    size_t Out = 0;
+    // Where the low Width bytes of a uint64_t start in memory
+    const unsigned Low = sys::IsBigEndianHost ? 8 - Width : 0;
+    const uint64_t One = 1;
+    uint32_t Draws[EncryptChunkSize];
+    for (size_t Begin = 0; Begin < NumElements; Begin += EncryptChunkSize) {
+      const size_t End = std::min(NumElements, Begin + EncryptChunkSize);
+      if (!KeystreamTemp)
+        cryptoutils->get_bytes(
+            reinterpret_cast<uint8_t *>(&Keys[Begin * Width]),
+            (End - Begin) * Width);
+      if (!AllEncrypted)
+        cryptoutils->fill(Draws, End - Begin);
+      for (size_t i = Begin; i < End; i++) {
+        const char *V = Raw.data() + i * Width;
+        // Multiply-shift maps the draw onto [0, 100) without a division
+        if (!AllEncrypted && ((uint64_t)Draws[i - Begin] * 100 >> 32) >=
+                                 ElementEncryptProbTemp) {
+          Skipped.emplace_back(i);
+          if (!KeystreamTemp)
+            memcpy(&Keys[i * Width],
+                   reinterpret_cast<const char *>(&One) + Low, Width);
+          if (DecryptInPlace) {
+            memcpy(&Encrypted[Out], V, Width);
+            Out += Width;
+          } else {
+            if (Dummy.empty())
+              Dummy.resize(Raw.size());
+            memcpy(&Dummy[i * Width], V, Width);
+          }
+          continue;
+        }
+        uint64_t Next;
+        const char *K;
+        if (KeystreamTemp) {
+          Next = keystreamNext(State);
+          K = reinterpret_cast<const char *>(&Next) + Low;
+        } else {
+          K = &Keys[i * Width];
+        }
+        for (unsigned b = 0; b < Width; b++)
+          Encrypted[Out++] = V[b] ^ K[b];
+      }
+    }
+    Encrypted.resize(Out);
+  }
+
+  // Whether any instruction using GV, looking through constant expressions,
+  // belongs to a function the pass runs on
+  bool isUsedByObfuscated(Constant *GV) {
+    for (User *U : GV->users()) {
+      if (Instruction *I = dyn_cast<Instruction>(U)) {
+        if (toObfuscate(flag, I->getFunction(), "strenc"))
+          return true;
+      } else if (ConstantExpr *CE = dyn_cast<ConstantExpr>(U)) {
+        if (isUsedByObfuscated(CE))
+          return true;
+      }
+    }
+    return false;
+  }
+
+  // Globals reachable from a function, in discovery order. Anything pushed
+  // while the worklist is being walked is visited later in the same walk.
+  using GlobalWorklist =
+      SetVector<GlobalVariable *, SmallVector<GlobalVariable *, 32>,
+                SmallPtrSet<GlobalVariable *, 32>>;
+
   void processStructMembers(ConstantStruct *CS,
                             SmallVector<GlobalVariable *, 32> *unhandleablegvs,
-                            SmallVector<GlobalVariable *, 32> *Globals,
-                            std::set<User *> *Users, bool *breakFor) {
+                            GlobalWorklist *Globals,
+                            SmallPtrSet<User *, 32> *Users) {
     for (unsigned i = 0; i < CS->getNumOperands(); i++) {
       Constant *Op = CS->getOperand(i);
       if (GlobalVariable *GV =
@@ -101,24 +366,19 @@ struct StringEncryption : public ModulePass {
           continue;
         }
         Users->insert(opaquepointers ? CS : Op);
-        if (std::find(Globals->begin(), Globals->end(), GV) == Globals->end()) {
-          Globals->emplace_back(GV);
-          *breakFor = true;
-        }
+        Globals->insert(GV);
       } else if (ConstantStruct *NestedCS = dyn_cast<ConstantStruct>(Op)) {
-        processStructMembers(NestedCS, unhandleablegvs, Globals, Users,
-                             breakFor);
+        processStructMembers(NestedCS, unhandleablegvs, Globals, Users);
       } else if (ConstantArray *NestedCA = dyn_cast<ConstantArray>(Op)) {
-        processArrayMembers(NestedCA, unhandleablegvs, Globals, Users,
-                            breakFor);
+        processArrayMembers(NestedCA, unhandleablegvs, Globals, Users);
       }
     }
   }
 
   void processArrayMembers(ConstantArray *CA,
                            SmallVector<GlobalVariable *, 32> *unhandleablegvs,
-                           SmallVector<GlobalVariable *, 32> *Globals,
-                           std::set<User *> *Users, bool *breakFor) {
+                           GlobalWorklist *Globals,
+                           SmallPtrSet<User *, 32> *Users) {
     for (unsigned i = 0; i < CA->getNumOperands(); i++) {
       Constant *Op = CA->getOperand(i);
       if (GlobalVariable *GV =
@@ -128,24 +388,19 @@ struct StringEncryption : public ModulePass {
           continue;
         }
         Users->insert(opaquepointers ? CA : Op);
-        if (std::find(Globals->begin(), Globals->end(), GV) == Globals->end()) {
-          Globals->emplace_back(GV);
-          *breakFor = true;
-        }
+        Globals->insert(GV);
       } else if (ConstantStruct *NestedCS = dyn_cast<ConstantStruct>(Op)) {
-        processStructMembers(NestedCS, unhandleablegvs, Globals, Users,
-                             breakFor);
+        processStructMembers(NestedCS, unhandleablegvs, Globals, Users);
       } else if (ConstantArray *NestedCA = dyn_cast<ConstantArray>(Op)) {
-        processArrayMembers(NestedCA, unhandleablegvs, Globals, Users,
-                            breakFor);
+        processArrayMembers(NestedCA, unhandleablegvs, Globals, Users);
       }
     }
   }
 
   void HandleFunction(Function *Func) {
     FixFunctionConstantExpr(Func);
-    SmallVector<GlobalVariable *, 32> Globals;
-    std::set<User *> Users;
+    GlobalWorklist Globals;
+    SmallPtrSet<User *, 32> Users;
     for (Instruction &I : instructions(Func))
       for (Value *Op : I.operands())
         if (GlobalVariable *G =
@@ -153,72 +408,53 @@ struct StringEncryption : public ModulePass {
           if (User *U = dyn_cast<User>(Op))
             Users.insert(U);
           Users.insert(&I);
-          Globals.emplace_back(G);
+          Globals.insert(G);
         }
     std::set<GlobalVariable *> rawStrings;
     std::set<GlobalVariable *> objCStrings;
     std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>> GV2Keys;
-    std::map<GlobalVariable * /*old*/,
+    DenseMap<GlobalVariable * /*old*/,
              std::pair<GlobalVariable * /*encrypted*/,
                        GlobalVariable * /*decrypt space*/>>
         old2new;
 
-    auto end = Globals.end();
-    for (auto it = Globals.begin(); it != end; ++it) {
-      end = std::remove(it + 1, end, *it);
-    }
-    Globals.erase(end, Globals.end());
-
     Module *M = Func->getParent();
 
-    SmallVector<GlobalVariable *, 32> transedGlobals, unhandleablegvs;
-
-    do {
-      for (GlobalVariable *GV : Globals) {
-        if (std::find(transedGlobals.begin(), transedGlobals.end(), GV) ==
-            transedGlobals.end()) {
-          bool breakThisFor = false;
-          if (handleableGV(GV)) {
-            if (GlobalVariable *CastedGV = dyn_cast<GlobalVariable>(
-                    GV->getInitializer()->stripPointerCasts())) {
-              if (std::find(Globals.begin(), Globals.end(), CastedGV) ==
-                  Globals.end()) {
-                Globals.emplace_back(CastedGV);
-                ConstantExpr *CE = dyn_cast<ConstantExpr>(GV->getInitializer());
-                Users.insert(CE ? CE : GV->getInitializer());
-                breakThisFor = true;
-              }
-            }
-            if (GV->getInitializer()->getType() ==
-                StructType::getTypeByName(M->getContext(),
-                                          "struct.__NSConstantString_tag")) {
-              objCStrings.insert(GV);
-              rawStrings.insert(cast<GlobalVariable>(
-                  cast<ConstantStruct>(GV->getInitializer())
-                      ->getOperand(2)
-                      ->stripPointerCasts()));
-            } else if (isa<ConstantDataSequential>(GV->getInitializer())) {
-              rawStrings.insert(GV);
-            } else if (ConstantStruct *CS =
-                           dyn_cast<ConstantStruct>(GV->getInitializer())) {
-              processStructMembers(CS, &unhandleablegvs, &Globals, &Users,
-                                   &breakThisFor);
-            } else if (ConstantArray *CA =
-                           dyn_cast<ConstantArray>(GV->getInitializer())) {
-              processArrayMembers(CA, &unhandleablegvs, &Globals, &Users,
-                                  &breakThisFor);
-            }
-          } else {
-            unhandleablegvs.emplace_back(GV);
-          }
-          transedGlobals.emplace_back(GV);
-          if (breakThisFor)
-            break;
+    SmallVector<GlobalVariable *, 32> unhandleablegvs;
+
+    for (unsigned i = 0; i < Globals.size(); i++) {
+      GlobalVariable *GV = Globals[i];
+      if (!handleableGV(GV)) {
+        unhandleablegvs.emplace_back(GV);
+        continue;
+      }
+      if (GlobalVariable *CastedGV = dyn_cast<GlobalVariable>(
+              GV->getInitializer()->stripPointerCasts())) {
+        if (Globals.insert(CastedGV)) {
+          ConstantExpr *CE = dyn_cast<ConstantExpr>(GV->getInitializer());
+          Users.insert(CE ? CE : GV->getInitializer());
         }
-      } // foreach loop
-    } while (transedGlobals.size() != Globals.size());
+      }
+      if (GV->getInitializer()->getType() ==
+          StructType::getTypeByName(M->getContext(),
+                                    "struct.__NSConstantString_tag")) {
+        objCStrings.insert(GV);
+        rawStrings.insert(
+            cast<GlobalVariable>(cast<ConstantStruct>(GV->getInitializer())
+                                     ->getOperand(2)
+                                     ->stripPointerCasts()));
+      } else if (isa<ConstantDataSequential>(GV->getInitializer())) {
+        rawStrings.insert(GV);
+      } else if (ConstantStruct *CS =
+                     dyn_cast<ConstantStruct>(GV->getInitializer())) {
+        processStructMembers(CS, &unhandleablegvs, &Globals, &Users);
+      } else if (ConstantArray *CA =
+                     dyn_cast<ConstantArray>(GV->getInitializer())) {
+        processArrayMembers(CA, &unhandleablegvs, &Globals, &Users);
+      }
+    }
     for (GlobalVariable *ugv : unhandleablegvs)
-      if (std::find(genedgv.begin(), genedgv.end(), ugv) != genedgv.end()) {
+      if (genedgv.count(ugv)) {
         std::pair<Constant *, GlobalVariable *> mgv2keysval = mgv2keys[ugv];
         if (ugv->getInitializer()->getType() ==
             StructType::getTypeByName(M->getContext(),
@@ -239,6 +475,14 @@ struct StringEncryption : public ModulePass {
       if (GV->getInitializer()->isZeroValue() ||
           GV->getInitializer()->isNullValue())
         continue;
+      if (pool) {
+        auto iter = pooled.find(GV);
+        if (iter != pooled.end()) {
+          old2new[GV] = iter->second;
+          GV2Keys[iter->second.second] = mgv2keys[iter->second.second];
+          continue;
+        }
+      }
       ConstantDataSequential *CDS =
           cast<ConstantDataSequential>(GV->getInitializer());
       Type *ElementTy = CDS->getElementType();
@@ -246,111 +490,98 @@ struct StringEncryption : public ModulePass {
         continue;
       }
       IntegerType *intType = cast<IntegerType>(ElementTy);
+      // Everything drawn for a string in a COMDAT group must be the same in
+      // every object file, so it comes from a stream keyed by its contents
+      std::unique_ptr<CryptoStream> ContentStream;
+      std::string ComdatName;
+      if (comdat) {
+        ComdatName = contentName(CDS, ContentStream);
+        auto iter = comdatpooled.find(ComdatName);
+        if (iter != comdatpooled.end()) {
+          old2new[GV] = pooled[GV] = iter->second;
+          GV2Keys[iter->second.second] = mgv2keys[iter->second.second];
+          continue;
+        }
+        // Someone else's symbol, or a module that was already obfuscated
+        if (M->getNamedValue(ComdatName))
+          ComdatName.clear();
+      }
       Constant *KeyConst, *EncryptedConst, *DummyConst = nullptr;
       unencryptedindex[GV] = {};
-      if (intType == Type::getInt8Ty(M->getContext())) {
-        std::vector<uint8_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProbTemp) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint8_t K = cryptoutils->get_uint8_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint8_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint8_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint8_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint8_t>(dummy));
-
-      } else if (intType == Type::getInt16Ty(M->getContext())) {
-        std::vector<uint16_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProbTemp) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint16_t K = cryptoutils->get_uint16_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint16_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint16_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint16_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint16_t>(dummy));
-      } else if (intType == Type::getInt32Ty(M->getContext())) {
-        std::vector<uint32_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProbTemp) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint32_t K = cryptoutils->get_uint32_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint32_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint32_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint32_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint32_t>(dummy));
-      } else if (intType == Type::getInt64Ty(M->getContext())) {
-        std::vector<uint64_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProbTemp) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint64_t K = cryptoutils->get_uint64_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint64_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint64_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint64_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint64_t>(dummy));
-      } else {
-        llvm_unreachable("Unsupported CDS Type");
+      // Seeds must be non-zero or xorshift gets stuck at zero
+      const uint64_t Seed = KeystreamTemp ? cryptoutils->get_uint64_t() | 1 : 0;
+      uint64_t State = Seed;
+      // In place, EncryptedString keeps every element at its own index and
+      // the plain text ones are stored as is. Strings reachable from other
+      // globals may be decrypted by several functions, which is only safe
+      // when decrypting into a copy.
+      const bool DecryptInPlace =
+          InPlaceTemp && (pool || onlyUsedIn(GV, Func));
+      {
+        std::string Keys, Encrypted, Dummy;
+        encryptElements(CDS->getRawDataValues(), CDS->getElementByteSize(),
+                        DecryptInPlace, State, unencryptedindex[GV], Keys,
+                        Encrypted, Dummy);
+        const unsigned Width = CDS->getElementByteSize();
+        // Only the seed is kept, the decryptor regenerates the keys from it
+        if (KeystreamTemp)
+          KeyConst =
+              ConstantInt::get(Type::getInt64Ty(M->getContext()), Seed);
+        else
+          KeyConst = ConstantDataArray::getRaw(Keys, Keys.size() / Width,
+                                               intType);
+        EncryptedConst = ConstantDataArray::getRaw(
+            Encrypted, Encrypted.size() / Width, intType);
+        // Whatever DecryptSpace holds where elements get decrypted is
+        // overwritten, so it is zero there rather than random
+        if (!DecryptInPlace)
+          DummyConst =
+              Dummy.empty()
+                  ? Constant::getNullValue(
+                        ArrayType::get(intType, CDS->getNumElements()))
+                  : ConstantDataArray::getRaw(Dummy, Dummy.size() / Width,
+                                              intType);
       }
       // Prepare new rawGV
       GlobalVariable *EncryptedRawGV = new GlobalVariable(
           *M, EncryptedConst->getType(), false, GV->getLinkage(),
           EncryptedConst, "EncryptedString", nullptr, GV->getThreadLocalMode(),
           GV->getType()->getAddressSpace());
-      genedgv.emplace_back(EncryptedRawGV);
-      GlobalVariable *DecryptSpaceGV = new GlobalVariable(
-          *M, DummyConst->getType(), false, GV->getLinkage(), DummyConst,
-          "DecryptSpace", nullptr, GV->getThreadLocalMode(),
-          GV->getType()->getAddressSpace());
-      genedgv.emplace_back(DecryptSpaceGV);
+      genedgv.insert(EncryptedRawGV);
+      GlobalVariable *DecryptSpaceGV = EncryptedRawGV;
+      if (!DecryptInPlace) {
+        DecryptSpaceGV = new GlobalVariable(
+            *M, DummyConst->getType(), false, GV->getLinkage(), DummyConst,
+            "DecryptSpace", nullptr, GV->getThreadLocalMode(),
+            GV->getType()->getAddressSpace());
+        genedgv.insert(DecryptSpaceGV);
+      }
       old2new[GV] = std::make_pair(EncryptedRawGV, DecryptSpaceGV);
       GV2Keys[DecryptSpaceGV] = std::make_pair(KeyConst, EncryptedRawGV);
-      mgv2keys[DecryptSpaceGV] = GV2Keys[DecryptSpaceGV];
+      // Decrypting in place twice would encrypt again, so other functions
+      // must never pick these up unless the pool decrypts them
+      if (!DecryptInPlace || pool)
+        mgv2keys[DecryptSpaceGV] = GV2Keys[DecryptSpaceGV];
       unencryptedindex[KeyConst] = unencryptedindex[GV];
+      Comdat *C = nullptr;
+      if (!ComdatName.empty()) {
+        C = M->getOrInsertComdat(ComdatName);
+        DecryptSpaceGV->setName(ComdatName);
+        if (EncryptedRawGV != DecryptSpaceGV)
+          EncryptedRawGV->setName(ComdatName + ".enc");
+        for (GlobalVariable *G : {EncryptedRawGV, DecryptSpaceGV}) {
+          G->setLinkage(GlobalValue::LinkageTypes::LinkOnceODRLinkage);
+          G->setVisibility(GlobalValue::VisibilityTypes::HiddenVisibility);
+          G->setComdat(C);
+        }
+        comdatpooled[ComdatName] = old2new[GV];
+      }
+      if (pool) {
+        pooled[GV] = old2new[GV];
+        Function *Decryptor = CreatePoolDecryptor(
+            M, DecryptSpaceGV, GV2Keys[DecryptSpaceGV], C);
+        pooldecryptor[DecryptSpaceGV] = Decryptor;
+      }
     }
     // Now prepare ObjC new GV
     for (GlobalVariable *GV : objCStrings) {
@@ -362,24 +593,25 @@ struct StringEncryption : public ModulePass {
         continue;
       GlobalVariable *EncryptedOCGV = ObjectiveCString(
           GV, "EncryptedStringObjC", old2new[oldrawString].first, CS);
-      genedgv.emplace_back(EncryptedOCGV);
+      genedgv.insert(EncryptedOCGV);
       GlobalVariable *DecryptSpaceOCGV = ObjectiveCString(
           GV, "DecryptSpaceObjC", old2new[oldrawString].second, CS);
-      genedgv.emplace_back(DecryptSpaceOCGV);
+      genedgv.insert(DecryptSpaceOCGV);
       old2new[GV] = std::make_pair(EncryptedOCGV, DecryptSpaceOCGV);
     } // End prepare ObjC new GV
     if (GV2Keys.empty())
       return;
-    // Replace Uses
-    for (User *U : Users) {
-      for (std::map<GlobalVariable *,
-                    std::pair<GlobalVariable *, GlobalVariable *>>::iterator
-               iter = old2new.begin();
-           iter != old2new.end(); ++iter) {
-        U->replaceUsesOfWith(iter->first, iter->second.second);
-        iter->first->removeDeadConstantUsers();
-      }
-    } // End Replace Uses
+    // Replace Uses in one sweep over the operands of every user
+    for (User *U : Users)
+      for (unsigned i = 0; i < U->getNumOperands(); i++)
+        if (GlobalVariable *Old = dyn_cast<GlobalVariable>(U->getOperand(i))) {
+          auto iter = old2new.find(Old);
+          if (iter != old2new.end())
+            U->replaceUsesOfWith(Old, iter->second.second);
+        }
+    for (auto &iter : old2new)
+      iter.first->removeDeadConstantUsers();
+    // End Replace Uses
       // CleanUp Old ObjC GVs
     for (GlobalVariable *GV : objCStrings) {
       GlobalVariable *PtrauthGV = nullptr;
@@ -430,18 +662,25 @@ struct StringEncryption : public ModulePass {
       }
     }
     // CleanUp Old Raw GVs
-    for (std::map<GlobalVariable *,
-                  std::pair<GlobalVariable *, GlobalVariable *>>::iterator
-             iter = old2new.begin();
-         iter != old2new.end(); ++iter) {
-      GlobalVariable *toDelete = iter->first;
+    for (auto &iter : old2new) {
+      GlobalVariable *toDelete = iter.first;
       toDelete->removeDeadConstantUsers();
       if (toDelete->getNumUses() == 0) {
+        pooled.erase(toDelete);
         toDelete->dropAllReferences();
         toDelete->eraseFromParent();
       }
     }
+    if (CtorDecryptTemp) {
+      HandleCtorDecryption(Func->getParent(), GV2Keys);
+      return;
+    }
     GlobalVariable *StatusGV = encstatus[Func];
+    if (LazyDecryptTemp) {
+      HandleLazyDecryption(Func, GV2Keys);
+      if (GV2Keys.empty())
+        return;
+    }
     /*
        - Split Original EntryPoint BB into A and C.
        - Create new BB as Decryption BB between A and C. Adjust the terminators
@@ -461,27 +700,194 @@ struct StringEncryption : public ModulePass {
     BranchInst *newBr = BranchInst::Create(B);
     ReplaceInstWithInst(A->getTerminator(), newBr);
     // Insert DecryptionCode
-    HandleDecryptionBlock(B, C, GV2Keys);
-    IRBuilder<> IRB(A->getFirstNonPHIOrDbgOrLifetime());
-    // Add atomic load checking status in A
-    LoadInst *LI = IRB.CreateLoad(StatusGV->getValueType(), StatusGV,
-                                  "LoadEncryptionStatus");
-    LI->setAtomic(
-        AtomicOrdering::Acquire); // Will be released at the start of C
-    LI->setAlignment(Align(4));
-    Value *condition = IRB.CreateICmpEQ(
-        LI, ConstantInt::get(Type::getInt32Ty(Func->getContext()), 0));
-    A->getTerminator()->eraseFromParent();
-    BranchInst::Create(B, C, condition, A);
-    // Add StoreInst atomically in C start
-    // No matter control flow is coming from A or B, the GVs must be decrypted
-    StoreInst *SI =
-        new StoreInst(ConstantInt::get(Type::getInt32Ty(Func->getContext()), 1),
-                      StatusGV, C->getFirstNonPHIOrDbgOrLifetime());
-    SI->setAlignment(Align(4));
-    SI->setAtomic(AtomicOrdering::Release); // Release the lock acquired in LI
+    BranchInst *DecryptEnd = HandleDecryptionBlock(B, C, GV2Keys);
+    HandleDecryptionStatus(StatusGV, A, B, C, DecryptEnd);
   } // End of HandleFunction
 
+  // Guard the decryption code B, which ends with DecryptEnd branching to C,
+  // with StatusGV through emitStatusClaim. A must end with an unconditional
+  // branch, which is replaced by the status check. Only the caller claiming
+  // StatusGV runs B, so the strings are decrypted exactly once, which in
+  // place decryption relies on.
+  void HandleDecryptionStatus(GlobalVariable *StatusGV, BasicBlock *A,
+                              BasicBlock *B, BasicBlock *C,
+                              BranchInst *DecryptEnd) {
+    // Publish the decrypted strings once B is done. This keeps the store off
+    // the path taken by every later call.
+    StoreInst *SI = new StoreInst(
+        ConstantInt::get(Type::getInt32Ty(A->getContext()), 1), StatusGV,
+        DecryptEnd);
+    SI->setAlignment(Align(4));
+    SI->setAtomic(AtomicOrdering::Release);
+    emitStatusClaim(StatusGV, A, B, C);
+  }
+
+  // void StringPoolDecrypt(), decrypting a pooled string behind a status of
+  // its own. Every function using the string calls it from its own
+  // decryption code.
+  Function *CreatePoolDecryptor(Module *M, GlobalVariable *DecryptSpace,
+                                std::pair<Constant *, GlobalVariable *> Keys,
+                                Comdat *Group) {
+    LLVMContext &Ctx = M->getContext();
+    Function *Decryptor = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), ArrayRef<Type *>(), false),
+        GlobalValue::LinkageTypes::PrivateLinkage, "StringPoolDecrypt", M);
+    Decryptor->addFnAttr(Attribute::NoInline);
+    Decryptor->addFnAttr(Attribute::NoUnwind);
+    genedfunc.insert(Decryptor);
+    Constant *S = ConstantInt::getNullValue(Type::getInt32Ty(Ctx));
+    GlobalVariable *StatusGV = new GlobalVariable(
+        *M, S->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage, S,
+        "StringEncryptionEncStatus");
+    BasicBlock *A = BasicBlock::Create(Ctx, "", Decryptor);
+    BasicBlock *C = BasicBlock::Create(Ctx, "", Decryptor);
+    ReturnInst::Create(Ctx, C);
+    BasicBlock *B = BasicBlock::Create(Ctx, "StringDecryptionBB", Decryptor, C);
+    BranchInst::Create(B, A);
+    std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>> One;
+    One[DecryptSpace] = Keys;
+    BranchInst *DecryptEnd = HandleDecryptionBlock(B, C, One);
+    HandleDecryptionStatus(StatusGV, A, B, C, DecryptEnd);
+    if (Group) {
+      // The linker keeps the decryptor, its status and the strings of one
+      // object file together, so they always agree on the keys
+      Decryptor->setName(Group->getName() + ".decrypt");
+      StatusGV->setName(Group->getName() + ".status");
+      for (GlobalObject *GO : std::initializer_list<GlobalObject *>{
+               Decryptor, StatusGV}) {
+        GO->setLinkage(GlobalValue::LinkageTypes::LinkOnceODRLinkage);
+        GO->setVisibility(GlobalValue::VisibilityTypes::HiddenVisibility);
+        GO->setComdat(Group);
+      }
+      for (Instruction &I : instructions(Decryptor))
+        for (Value *Op : I.operands())
+          if (GlobalVariable *G =
+                  dyn_cast<GlobalVariable>(Op->stripPointerCasts()))
+            if (G->hasPrivateLinkage() && !G->hasComdat() &&
+                onlyUsedIn(G, Decryptor))
+              G->setComdat(Group);
+    }
+    return Decryptor;
+  }
+
+  // -strcry_comdat: name of the group holding the string in CDS. Switches CS
+  // to a stream keyed by the contents, so the name and everything drawn for
+  // the string afterwards depend only on them and the seed.
+  static std::string contentName(ConstantDataSequential *CDS,
+                                 std::unique_ptr<CryptoStream> &CS) {
+    MD5 Hash;
+    Hash.update(utostr(CDS->getElementByteSize()));
+    Hash.update(CDS->getRawDataValues());
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    CS = std::make_unique<CryptoStream>(Result.digest(), "strenc.comdat");
+    uint8_t Name[16];
+    cryptoutils->get_bytes(Name, sizeof(Name));
+    return "__hikari_str_" + toHex(ArrayRef<uint8_t>(Name), true);
+  }
+
+  // Decrypt GV2Keys once from a module constructor, so the function itself
+  // is left untouched. Every function in this mode appends its decryption
+  // block to the same constructor.
+  void HandleCtorDecryption(
+      Module *M,
+      std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
+          &GV2Keys) {
+    if (!decryptctor) {
+      FunctionType *CtorType = FunctionType::get(
+          Type::getVoidTy(M->getContext()), ArrayRef<Type *>(), false);
+      decryptctor = Function::Create(CtorType,
+                                     GlobalValue::LinkageTypes::PrivateLinkage,
+                                     "StringDecryptionCtor", M);
+      genedfunc.insert(decryptctor);
+      BasicBlock *EntryBB =
+          BasicBlock::Create(M->getContext(), "", decryptctor);
+      decryptctorend = BasicBlock::Create(M->getContext(), "", decryptctor);
+      ReturnInst::Create(M->getContext(), decryptctorend);
+      decryptctortail = BranchInst::Create(decryptctorend, EntryBB);
+      appendToGlobalCtors(*M, decryptctor, CtorDecryptPriority);
+    }
+    BasicBlock *B = BasicBlock::Create(M->getContext(), "StringDecryptionBB",
+                                       decryptctor, decryptctorend);
+    decryptctortail->setSuccessor(0, B);
+    decryptctortail = HandleDecryptionBlock(B, decryptctorend, GV2Keys);
+  }
+
+  // Move every string whose uses are all instructions of Func out of
+  // GV2Keys and decrypt it, under a status of its own, in the nearest
+  // common dominator of those uses. Strings only reachable through other
+  // globals are left in GV2Keys for the entry block.
+  void HandleLazyDecryption(
+      Function *Func,
+      std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
+          &GV2Keys) {
+    // Pick every insertion point before touching the CFG. Splitting blocks
+    // afterwards keeps each chosen instruction dominating its string's uses.
+    DominatorTree DT(*Func);
+    std::vector<std::pair<GlobalVariable *, Instruction *>> InsertPts;
+    for (auto &iter : GV2Keys) {
+      SmallVector<User *, 16> Worklist(iter.first->users());
+      SmallPtrSet<Instruction *, 16> UsePts;
+      BasicBlock *Dom = nullptr;
+      bool Lazy = true;
+      while (Lazy && !Worklist.empty()) {
+        User *U = Worklist.pop_back_val();
+        if (isa<ConstantExpr>(U)) {
+          Worklist.append(U->user_begin(), U->user_end());
+          continue;
+        }
+        Instruction *I = dyn_cast<Instruction>(U);
+        if (!I || I->getFunction() != Func || I->isEHPad()) {
+          Lazy = false;
+          break;
+        }
+        // A PHI reads its incoming values at the end of the incoming blocks
+        SmallVector<Instruction *, 4> Pts;
+        if (PHINode *PN = dyn_cast<PHINode>(I)) {
+          for (BasicBlock *Incoming : PN->blocks())
+            Pts.emplace_back(Incoming->getTerminator());
+        } else {
+          Pts.emplace_back(I);
+        }
+        for (Instruction *Pt : Pts) {
+          // Code that never runs doesn't need the string decrypted
+          if (!DT.isReachableFromEntry(Pt->getParent()))
+            continue;
+          UsePts.insert(Pt);
+          Dom = Dom ? DT.findNearestCommonDominator(Dom, Pt->getParent())
+                    : Pt->getParent();
+        }
+      }
+      if (!Lazy || !Dom)
+        continue;
+      Instruction *InsertPt = Dom->getTerminator();
+      for (Instruction &I : *Dom)
+        if (UsePts.count(&I)) {
+          InsertPt = &I;
+          break;
+        }
+      InsertPts.emplace_back(iter.first, InsertPt);
+    }
+
+    Module *M = Func->getParent();
+    for (auto &InsertPt : InsertPts) {
+      std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>> One;
+      One[InsertPt.first] = GV2Keys[InsertPt.first];
+      GV2Keys.erase(InsertPt.first);
+      Constant *S =
+          ConstantInt::getNullValue(Type::getInt32Ty(M->getContext()));
+      GlobalVariable *StatusGV = new GlobalVariable(
+          *M, S->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
+          S, "StringEncryptionEncStatus");
+      BasicBlock *A = InsertPt.second->getParent();
+      BasicBlock *C = A->splitBasicBlock(InsertPt.second, "PrecedingBlock");
+      BasicBlock *B =
+          BasicBlock::Create(Func->getContext(), "StringDecryptionBB", Func, C);
+      BranchInst *DecryptEnd = HandleDecryptionBlock(B, C, One);
+      HandleDecryptionStatus(StatusGV, A, B, C, DecryptEnd);
+    }
+  }
+
   GlobalVariable *ObjectiveCString(GlobalVariable *GV, std::string name,
                                    GlobalVariable *newString,
                                    ConstantStruct *CS) {
@@ -533,7 +939,7 @@ struct StringEncryption : public ModulePass {
     return ObjcGV;
   }
 
-  void HandleDecryptionBlock(
+  BranchInst *HandleDecryptionBlock(
       BasicBlock *B, BasicBlock *C,
       std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
           &GV2Keys) {
@@ -543,22 +949,62 @@ struct StringEncryption : public ModulePass {
                   std::pair<Constant *, GlobalVariable *>>::iterator iter =
              GV2Keys.begin();
          iter != GV2Keys.end(); ++iter) {
+      auto pooliter = pooldecryptor.find(iter->first);
+      if (pooliter != pooldecryptor.end()) {
+        IRB.CreateCall(pooliter->second);
+        continue;
+      }
       Constant *KeyConst = iter->second.first;
-      ConstantDataArray *CastedCDA = cast<ConstantDataArray>(KeyConst);
       // Prevent optimization of encrypted data
       appendToCompilerUsed(*iter->second.second->getParent(),
                            {iter->second.second});
+      uint64_t NumElements =
+          cast<ArrayType>(iter->first->getValueType())->getNumElements();
+      BitVector Skip(NumElements);
+      for (unsigned i : unencryptedindex[KeyConst])
+        Skip.set(i);
+      if (Skip.all())
+        continue;
+      if (isa<ConstantInt>(KeyConst)) {
+        EmitDecryptionLoop(IRB, C, iter->first, iter->second.second, KeyConst,
+                           Skip);
+        continue;
+      }
+      ConstantDataArray *CastedCDA = cast<ConstantDataArray>(KeyConst);
+      if (DecryptHelperTemp && Skip.none()) {
+        // XOR is bytewise, so the key array can be applied to the raw
+        // memory of the encrypted string whatever its element width
+        Module *M = B->getModule();
+        GlobalVariable *KeyGV = new GlobalVariable(
+            *M, CastedCDA->getType(), true,
+            GlobalValue::LinkageTypes::PrivateLinkage, CastedCDA,
+            "StringDecryptionKey");
+        Type *I8PtrTy = Type::getInt8PtrTy(B->getContext());
+        IRB.CreateCall(
+            GetDecryptionHelper(M),
+            {IRB.CreatePointerCast(iter->first, I8PtrTy),
+             IRB.CreatePointerCast(iter->second.second, I8PtrTy),
+             IRB.CreatePointerCast(KeyGV, I8PtrTy),
+             ConstantInt::get(
+                 Type::getInt64Ty(B->getContext()),
+                 M->getDataLayout().getTypeAllocSize(CastedCDA->getType()))});
+        continue;
+      }
+      if (NumElements > DecryptUnrollLimitTemp) {
+        EmitDecryptionLoop(IRB, C, iter->first, iter->second.second, CastedCDA,
+                           Skip);
+        continue;
+      }
       // Element-By-Element XOR so the fucking verifier won't complain
       // Also, this hides keys
+      // In place decryption reads every element from its own index
+      bool DecryptInPlace = iter->first == iter->second.second;
       uint64_t realkeyoff = 0;
-      for (uint64_t i = 0; i < CastedCDA->getType()->getNumElements(); i++) {
-        if (unencryptedindex[KeyConst].size() &&
-            std::find(unencryptedindex[KeyConst].begin(),
-                      unencryptedindex[KeyConst].end(),
-                      i) != unencryptedindex[KeyConst].end())
+      for (uint64_t i = 0; i < NumElements; i++) {
+        if (Skip.test(i))
           continue;
-        Value *offset =
-            ConstantInt::get(Type::getInt64Ty(B->getContext()), realkeyoff);
+        Value *offset = ConstantInt::get(Type::getInt64Ty(B->getContext()),
+                                         DecryptInPlace ? i : realkeyoff);
         Value *offset2 = ConstantInt::get(Type::getInt64Ty(B->getContext()), i);
         Value *EncryptedGEP =
             IRB.CreateGEP(iter->second.second->getValueType(),
@@ -572,8 +1018,771 @@ struct StringEncryption : public ModulePass {
         realkeyoff++;
       }
     }
-    IRB.CreateBr(C);
+    return IRB.CreateBr(C);
   } // End of HandleDecryptionBlock
+
+  // void StringDecryptionHelper(i8 *dst, i8 *src, i8 *key, i64 len)
+  // dst[i] = src[i] ^ key[i], sixteen bytes at a time using <16 x i8>
+  // vectors which the backend lowers to whatever the target provides,
+  // followed by a scalar loop for the remaining bytes.
+  Function *GetDecryptionHelper(Module *M) {
+    if (decrypthelper)
+      return decrypthelper;
+    LLVMContext &Ctx = M->getContext();
+    Type *I8Ty = Type::getInt8Ty(Ctx);
+    Type *I8PtrTy = Type::getInt8PtrTy(Ctx);
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    FixedVectorType *VecTy = FixedVectorType::get(I8Ty, 16);
+    Type *VecPtrTy = VecTy->getPointerTo();
+    FunctionType *FTy =
+        FunctionType::get(Type::getVoidTy(Ctx),
+                          {I8PtrTy, I8PtrTy, I8PtrTy, I64Ty}, false);
+    decrypthelper =
+        Function::Create(FTy, GlobalValue::LinkageTypes::PrivateLinkage,
+                         "StringDecryptionHelper", M);
+    genedfunc.insert(decrypthelper);
+    decrypthelper->addFnAttr(Attribute::NoUnwind);
+    Value *Dst = decrypthelper->getArg(0);
+    Value *Src = decrypthelper->getArg(1);
+    Value *Key = decrypthelper->getArg(2);
+    Value *Len = decrypthelper->getArg(3);
+
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", decrypthelper);
+    BasicBlock *Vector = BasicBlock::Create(Ctx, "vector", decrypthelper);
+    BasicBlock *TailCheck =
+        BasicBlock::Create(Ctx, "tailcheck", decrypthelper);
+    BasicBlock *Tail = BasicBlock::Create(Ctx, "tail", decrypthelper);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", decrypthelper);
+
+    IRBuilder<> IRB(Entry);
+    Value *VecEnd = IRB.CreateAnd(Len, ConstantInt::get(I64Ty, -16));
+    IRB.CreateCondBr(IRB.CreateICmpNE(VecEnd, ConstantInt::get(I64Ty, 0)),
+                     Vector, TailCheck);
+
+    IRB.SetInsertPoint(Vector);
+    PHINode *VecIdx = IRB.CreatePHI(I64Ty, 2);
+    auto VecPtr = [&](Value *Base) {
+      return IRB.CreatePointerCast(IRB.CreateGEP(I8Ty, Base, VecIdx),
+                                   VecPtrTy);
+    };
+    Value *EncVec = IRB.CreateAlignedLoad(VecTy, VecPtr(Src), Align(1));
+    Value *KeyVec = IRB.CreateAlignedLoad(VecTy, VecPtr(Key), Align(1));
+    IRB.CreateAlignedStore(IRB.CreateXor(EncVec, KeyVec), VecPtr(Dst),
+                           Align(1));
+    Value *VecNext = IRB.CreateAdd(VecIdx, ConstantInt::get(I64Ty, 16));
+    IRB.CreateCondBr(IRB.CreateICmpULT(VecNext, VecEnd), Vector, TailCheck);
+    VecIdx->addIncoming(ConstantInt::get(I64Ty, 0), Entry);
+    VecIdx->addIncoming(VecNext, Vector);
+
+    IRB.SetInsertPoint(TailCheck);
+    IRB.CreateCondBr(IRB.CreateICmpULT(VecEnd, Len), Tail, Exit);
+
+    IRB.SetInsertPoint(Tail);
+    PHINode *Idx = IRB.CreatePHI(I64Ty, 2);
+    Value *Enc = IRB.CreateLoad(I8Ty, IRB.CreateGEP(I8Ty, Src, Idx));
+    Value *K = IRB.CreateLoad(I8Ty, IRB.CreateGEP(I8Ty, Key, Idx));
+    IRB.CreateStore(IRB.CreateXor(Enc, K), IRB.CreateGEP(I8Ty, Dst, Idx));
+    Value *Next = IRB.CreateAdd(Idx, ConstantInt::get(I64Ty, 1));
+    IRB.CreateCondBr(IRB.CreateICmpULT(Next, Len), Tail, Exit);
+    Idx->addIncoming(VecEnd, TailCheck);
+    Idx->addIncoming(Next, Tail);
+
+    IRB.SetInsertPoint(Exit);
+    IRB.CreateRetVoid();
+    return decrypthelper;
+  }
+
+  // Decrypt DecryptSpace with a loop instead of one XOR per element.
+  // KeyConst is either the key array, whose encrypted elements are packed
+  // into a private array indexed like EncryptedString, or the ConstantInt
+  // seed of a keystream regenerated with keystreamNext(). Elements that
+  // were left in plain text are described by a bitmap with one bit per
+  // element.
+  void EmitDecryptionLoop(IRBuilder<> &IRB, BasicBlock *C,
+                          GlobalVariable *DecryptSpace,
+                          GlobalVariable *EncryptedGV, Constant *KeyConst,
+                          const BitVector &Skip) {
+    Module *M = DecryptSpace->getParent();
+    LLVMContext &Ctx = M->getContext();
+    Function *F = C->getParent();
+    Type *I8Ty = Type::getInt8Ty(Ctx);
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    ArrayType *ArrTy = cast<ArrayType>(DecryptSpace->getValueType());
+    Type *ElementTy = ArrTy->getElementType();
+    Value *zero = ConstantInt::get(Type::getInt32Ty(Ctx), 0);
+    uint64_t NumElements = ArrTy->getNumElements();
+
+    GlobalVariable *KeyGV = nullptr;
+    if (ConstantDataArray *KeyCDA = dyn_cast<ConstantDataArray>(KeyConst)) {
+      SmallVector<Constant *, 32> keys;
+      for (uint64_t i = 0; i < NumElements; i++)
+        if (!Skip.test(i))
+          keys.emplace_back(KeyCDA->getElementAsConstant(i));
+      Constant *KeysConst =
+          ConstantArray::get(ArrayType::get(ElementTy, keys.size()), keys);
+      KeyGV = new GlobalVariable(*M, KeysConst->getType(), true,
+                                 GlobalValue::LinkageTypes::PrivateLinkage,
+                                 KeysConst, "StringDecryptionKey");
+    }
+    GlobalVariable *MaskGV = nullptr;
+    if (Skip.any()) {
+      std::vector<uint8_t> mask((NumElements + 7) / 8, 0);
+      for (unsigned i : Skip.set_bits())
+        mask[i / 8] |= 1 << (i % 8);
+      Constant *MaskConst =
+          ConstantDataArray::get(Ctx, ArrayRef<uint8_t>(mask));
+      MaskGV = new GlobalVariable(*M, MaskConst->getType(), true,
+                                  GlobalValue::LinkageTypes::PrivateLinkage,
+                                  MaskConst, "StringDecryptionSkipMask");
+    }
+
+    BasicBlock *Preheader = IRB.GetInsertBlock();
+    BasicBlock *Header =
+        BasicBlock::Create(Ctx, "StringDecryptionLoop", F, C);
+    BasicBlock *Body = Header, *Latch = Header;
+    if (MaskGV) {
+      Body = BasicBlock::Create(Ctx, "StringDecryptionLoopBody", F, C);
+      Latch = BasicBlock::Create(Ctx, "StringDecryptionLoopLatch", F, C);
+    }
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "StringDecryptionLoopEnd", F, C);
+    IRB.CreateBr(Header);
+
+    IRB.SetInsertPoint(Header);
+    PHINode *Index = IRB.CreatePHI(I64Ty, 2, "DecryptIndex");
+    // Values below only advance when an element is actually decrypted
+    SmallVector<std::pair<PHINode *, Value *>, 2> Carried;
+    PHINode *KeyIndex = nullptr, *State = nullptr;
+    if (MaskGV) {
+      KeyIndex = IRB.CreatePHI(I64Ty, 2, "DecryptKeyIndex");
+      Carried.emplace_back(KeyIndex, ConstantInt::get(I64Ty, 0));
+    }
+    if (!KeyGV) {
+      State = IRB.CreatePHI(I64Ty, 2, "KeystreamState");
+      Carried.emplace_back(State, KeyConst);
+    }
+    if (MaskGV) {
+      // Plain text elements have their bit set and are left untouched
+      Value *MaskGEP = IRB.CreateGEP(MaskGV->getValueType(), MaskGV,
+                                     {zero, IRB.CreateLShr(Index, 3)});
+      Value *MaskByte = IRB.CreateLoad(I8Ty, MaskGEP, "SkipMask");
+      Value *Shift = IRB.CreateTrunc(IRB.CreateAnd(Index, 7), I8Ty);
+      Value *SkipBit = IRB.CreateAnd(IRB.CreateLShr(MaskByte, Shift), 1);
+      IRB.CreateCondBr(IRB.CreateICmpEQ(SkipBit, ConstantInt::get(I8Ty, 0)),
+                       Body, Latch);
+      IRB.SetInsertPoint(Body);
+    }
+    Value *Offset = KeyIndex ? KeyIndex : Index;
+    Value *EncryptedGEP =
+        IRB.CreateGEP(EncryptedGV->getValueType(), EncryptedGV,
+                      {zero, EncryptedGV == DecryptSpace ? Index : Offset});
+    Value *DecryptedGEP = IRB.CreateGEP(DecryptSpace->getValueType(),
+                                        DecryptSpace, {zero, Index});
+    LoadInst *LI = IRB.CreateLoad(ElementTy, EncryptedGEP, "EncryptedChar");
+    Value *Key, *NextState = nullptr;
+    if (KeyGV) {
+      Value *KeyGEP =
+          IRB.CreateGEP(KeyGV->getValueType(), KeyGV, {zero, Offset});
+      Key = IRB.CreateLoad(ElementTy, KeyGEP, "Key");
+    } else {
+      NextState = IRB.CreateXor(State, IRB.CreateShl(State, 13));
+      NextState = IRB.CreateXor(NextState, IRB.CreateLShr(NextState, 7));
+      NextState = IRB.CreateXor(NextState, IRB.CreateShl(NextState, 17));
+      Key = IRB.CreateTrunc(NextState, ElementTy, "Key");
+    }
+    IRB.CreateStore(IRB.CreateXor(LI, Key), DecryptedGEP);
+    SmallVector<Value *, 2> Next;
+    if (KeyIndex)
+      Next.emplace_back(IRB.CreateAdd(KeyIndex, ConstantInt::get(I64Ty, 1)));
+    if (State)
+      Next.emplace_back(NextState);
+    if (MaskGV) {
+      IRB.CreateBr(Latch);
+      IRB.SetInsertPoint(Latch);
+    }
+    for (unsigned i = 0; i < Carried.size(); i++) {
+      PHINode *PN = Carried[i].first;
+      Value *Incoming = Next[i];
+      if (MaskGV) {
+        PHINode *LatchPHI = IRB.CreatePHI(I64Ty, 2);
+        LatchPHI->addIncoming(PN, Header);
+        LatchPHI->addIncoming(Next[i], Body);
+        Incoming = LatchPHI;
+      }
+      PN->addIncoming(Carried[i].second, Preheader);
+      PN->addIncoming(Incoming, Latch);
+    }
+    Value *NextIndex = IRB.CreateAdd(Index, ConstantInt::get(I64Ty, 1));
+    IRB.CreateCondBr(
+        IRB.CreateICmpULT(NextIndex, ConstantInt::get(I64Ty, NumElements)),
+        Header, Exit);
+    Index->addIncoming(ConstantInt::get(I64Ty, 0), Preheader);
+    Index->addIncoming(NextIndex, Latch);
+    IRB.SetInsertPoint(Exit);
+  }
+
+  // -strcry_pages: replace GV by a copy encrypted one page at a time, each
+  // with its own keystream seed, and padded to whole pages in a page
+  // aligned section. The module constructor maps those pages PROT_NONE and
+  // the first access to each page faults into the handler, which decrypts
+  // that page only. The kernel reports EFAULT rather than faulting when a
+  // system call touches a protected page, so calls handing it a buffer
+  // first decrypt the pages in that byte range, see HookKernelBuffers.
+  void HandlePageProtection(GlobalVariable *GV) {
+    ConstantDataArray *CDA = dyn_cast<ConstantDataArray>(GV->getInitializer());
+    if (!CDA || GV->isThreadLocal() ||
+        CDA->getRawDataValues().size() < PageProtectMin)
+      return;
+    Module *M = GV->getParent();
+    LLVMContext &Ctx = M->getContext();
+    Type *I8Ty = Type::getInt8Ty(Ctx);
+    Type *I32Ty = Type::getInt32Ty(Ctx);
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    Type *I8PtrTy = Type::getInt8PtrTy(Ctx);
+
+    std::string Data = CDA->getRawDataValues().str();
+    std::vector<uint64_t> Seeds;
+    for (uint64_t Off = 0; Off < Data.size(); Off += ProtectedPageSize) {
+      // Seeds must be non-zero or xorshift gets stuck at zero
+      uint64_t State = cryptoutils->get_uint64_t() | 1;
+      Seeds.emplace_back(State);
+      uint64_t End = std::min<uint64_t>(Off + ProtectedPageSize, Data.size());
+      for (uint64_t i = Off; i < End; i++)
+        Data[i] ^= static_cast<uint8_t>(keystreamNext(State));
+    }
+    // Nothing else may share the last page, the handler's own globals
+    // included
+    ArrayType *PadTy = ArrayType::get(
+        I8Ty, alignTo(Data.size(), ProtectedPageSize) - Data.size());
+    StructType *PagesTy = StructType::get(Ctx, {CDA->getType(), PadTy});
+    Constant *Pages = ConstantStruct::get(
+        PagesTy, {ConstantDataArray::getRaw(Data, CDA->getNumElements(),
+                                            CDA->getElementType()),
+                  Constant::getNullValue(PadTy)});
+    GlobalVariable *PagesGV = new GlobalVariable(
+        *M, PagesTy, false, GV->getLinkage(), Pages, "", GV,
+        GlobalValue::NotThreadLocal, GV->getType()->getAddressSpace());
+    PagesGV->takeName(GV);
+    PagesGV->setSection("hikari_pages");
+    PagesGV->setAlignment(Align(ProtectedPageSize));
+    genedgv.insert(PagesGV);
+    Constant *Zero = ConstantInt::get(I32Ty, 0);
+    GV->replaceAllUsesWith(ConstantExpr::getInBoundsGetElementPtr(
+        PagesTy, PagesGV, ArrayRef<Constant *>{Zero, Zero}));
+    GV->eraseFromParent();
+    GlobalVariable *SeedsGV = new GlobalVariable(
+        *M, ArrayType::get(I64Ty, Seeds.size()), true,
+        GlobalValue::LinkageTypes::PrivateLinkage,
+        ConstantDataArray::get(Ctx, ArrayRef<uint64_t>(Seeds)),
+        "StringPageSeeds");
+    // One status word per page, used like the per string ones of
+    // HandleDecryptionStatus: 0 encrypted, 2 being decrypted, 1 decrypted
+    ArrayType *StatusTy = ArrayType::get(I32Ty, Seeds.size());
+    GlobalVariable *StatusGV = new GlobalVariable(
+        *M, StatusTy, false, GlobalValue::LinkageTypes::PrivateLinkage,
+        Constant::getNullValue(StatusTy), "StringPageStatus");
+    StatusGV->setAlignment(Align(4));
+    genedgv.insert(SeedsGV);
+    genedgv.insert(StatusGV);
+    if (!pagehandler) {
+      CreatePageFaultHandler(M);
+      CreateKernelBufferHook(M);
+    }
+
+    Constant *Start = ConstantExpr::getPointerCast(PagesGV, I8PtrTy);
+    Function *Decrypt =
+        CreatePagesDecrypt(M, Start, Data.size(), SeedsGV, StatusGV);
+    Value *PageSize = ConstantInt::get(I64Ty, ProtectedPageSize);
+    Function *Init = pageinittail->getFunction();
+    BasicBlock *InitEnd = pageinittail->getSuccessor(0);
+    BasicBlock *InitPrev = pageinittail->getParent();
+    BasicBlock *Protect =
+        BasicBlock::Create(Ctx, "ProtectPage", Init, InitEnd);
+    BasicBlock *MapNone = BasicBlock::Create(Ctx, "MapPageNone", Init, InitEnd);
+    BasicBlock *Eager =
+        BasicBlock::Create(Ctx, "DecryptPageNow", Init, InitEnd);
+    BasicBlock *Abort = BasicBlock::Create(Ctx, "AbortPages", Init, InitEnd);
+    BasicBlock *NextPage = BasicBlock::Create(Ctx, "NextPage", Init, InitEnd);
+    BasicBlock *Protected =
+        BasicBlock::Create(Ctx, "ProtectedPages", Init, InitEnd);
+    pageinittail->setSuccessor(0, Protect);
+    // An earlier constructor may have handed pages to the kernel already,
+    // and those are decrypted and must not be protected again
+    IRBuilder<> IRB(Protect);
+    PHINode *Page = IRB.CreatePHI(I64Ty, 2);
+    Value *Status = IRB.CreateLoad(
+        I32Ty, IRB.CreateInBoundsGEP(StatusTy, StatusGV,
+                                     {ConstantInt::get(I64Ty, 0), Page}));
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Status, Zero), MapNone, NextPage);
+    IRB.SetInsertPoint(MapNone);
+    Value *Failed = IRB.CreateCall(
+        M->getOrInsertFunction("mprotect", I32Ty, I8PtrTy, I64Ty, I32Ty),
+        {IRB.CreateGEP(I8Ty, Start,
+                       IRB.CreateShl(Page, Log2_64(ProtectedPageSize))),
+         PageSize, ConstantInt::get(I32Ty, ProtNone)});
+    IRB.CreateCondBr(IRB.CreateICmpNE(Failed, Zero), Eager, NextPage);
+    // The page is still readable, so rather than leave it encrypted,
+    // decrypt it now
+    IRB.SetInsertPoint(Eager);
+    IRB.CreateCondBr(IRB.CreateCall(Decrypt, {Page, Page}), NextPage, Abort);
+    IRB.SetInsertPoint(Abort);
+    IRB.CreateCall(M->getOrInsertFunction("abort", Type::getVoidTy(Ctx)));
+    IRB.CreateUnreachable();
+    IRB.SetInsertPoint(NextPage);
+    Value *Next = IRB.CreateAdd(Page, ConstantInt::get(I64Ty, 1));
+    IRB.CreateCondBr(
+        IRB.CreateICmpULT(Next, ConstantInt::get(I64Ty, Seeds.size())),
+        Protect, Protected);
+    Page->addIncoming(ConstantInt::get(I64Ty, 0), InitPrev);
+    Page->addIncoming(Next, NextPage);
+    IRB.SetInsertPoint(Protected);
+    pageinittail = IRB.CreateBr(InitEnd);
+
+    Constant *Span = ConstantInt::get(
+        I64Ty, alignTo(Data.size(), ProtectedPageSize));
+    BasicBlock *Check = BasicBlock::Create(Ctx, "CheckPages", pagehandler,
+                                           pagehandlerfallback);
+    BasicBlock *Handle = BasicBlock::Create(Ctx, "DecryptPage", pagehandler,
+                                            pagehandlerfallback);
+    BasicBlock *Busy = BasicBlock::Create(Ctx, "PageBusy", pagehandler,
+                                          pagehandlerfallback);
+    BasicBlock *Decrypted = BasicBlock::Create(Ctx, "DecryptedPage",
+                                               pagehandler,
+                                               pagehandlerfallback);
+    pagehandlertail->setSuccessor(pagehandlertail->getNumSuccessors() - 1,
+                                  Check);
+    IRB.SetInsertPoint(Check);
+    // si_addr follows si_signo, si_errno, si_code and the union's padding
+    Value *AddrPtr = IRB.CreatePointerCast(
+        IRB.CreateConstGEP1_64(I8Ty, pagehandler->getArg(1), 16),
+        I64Ty->getPointerTo());
+    Value *Offset = IRB.CreateSub(IRB.CreateLoad(I64Ty, AddrPtr),
+                                  IRB.CreatePtrToInt(Start, I64Ty));
+    pagehandlertail = IRB.CreateCondBr(IRB.CreateICmpULT(Offset, Span),
+                                       Handle, pagehandlerfallback);
+    IRB.SetInsertPoint(Handle);
+    Value *Result = CallPageDecryptor(
+        IRB, Start, Data.size(), SeedsGV, StatusGV,
+        IRB.CreateLShr(Offset, Log2_64(ProtectedPageSize)));
+    // If the page could not be decrypted, fault like any other access
+    SwitchInst *SI = IRB.CreateSwitch(Result, Decrypted, 2);
+    SI->addCase(IRB.getInt32(0), pagehandlerfallback);
+    SI->addCase(IRB.getInt32(2), Busy);
+    // Another thread is decrypting the page. Rather than wait for it here,
+    // return and let the access fault again until it is done.
+    IRB.SetInsertPoint(Busy);
+    IRB.CreateCall(M->getOrInsertFunction("sched_yield",
+                                          FunctionType::get(I32Ty, false)));
+    IRB.CreateRetVoid();
+    IRB.SetInsertPoint(Decrypted);
+    IRB.CreateRetVoid();
+
+    BasicBlock *KernelEnd = pagekerneltail->getSuccessor(0);
+    BasicBlock *Overlap = BasicBlock::Create(Ctx, "CheckKernelBuffer",
+                                             pagekernel, KernelEnd);
+    BasicBlock *Range = BasicBlock::Create(Ctx, "DecryptKernelBuffer",
+                                           pagekernel, KernelEnd);
+    BasicBlock *Skip = BasicBlock::Create(Ctx, "", pagekernel, KernelEnd);
+    pagekerneltail->setSuccessor(0, Overlap);
+    IRB.SetInsertPoint(Overlap);
+    Value *Base = IRB.CreatePtrToInt(Start, I64Ty);
+    Value *Limit = IRB.CreateAdd(Base, ConstantInt::get(I64Ty, Data.size()));
+    Value *Lo = IRB.CreatePtrToInt(pagekernel->getArg(0), I64Ty);
+    Value *Hi = IRB.CreateAdd(Lo, pagekernel->getArg(1));
+    Lo = IRB.CreateSelect(IRB.CreateICmpULT(Lo, Base), Base, Lo);
+    Hi = IRB.CreateSelect(IRB.CreateICmpULT(Limit, Hi), Limit, Hi);
+    IRB.CreateCondBr(IRB.CreateICmpULT(Lo, Hi), Range, Skip);
+    // A page that cannot be decrypted is left for the call to fail on
+    IRB.SetInsertPoint(Range);
+    IRB.CreateCall(
+        Decrypt,
+        {IRB.CreateLShr(IRB.CreateSub(Lo, Base), Log2_64(ProtectedPageSize)),
+         IRB.CreateLShr(
+             IRB.CreateSub(IRB.CreateSub(Hi, Base), ConstantInt::get(I64Ty, 1)),
+             Log2_64(ProtectedPageSize))});
+    IRB.CreateBr(Skip);
+    IRB.SetInsertPoint(Skip);
+    pagekerneltail = IRB.CreateBr(KernelEnd);
+  }
+
+  // Calls StringPageDecrypt on the page numbered Page of the protected
+  // string at Start, returning its result
+  Value *CallPageDecryptor(IRBuilder<> &IRB, Constant *Start, uint64_t Size,
+                           GlobalVariable *SeedsGV, GlobalVariable *StatusGV,
+                           Value *Page) {
+    Module *M = IRB.GetInsertBlock()->getModule();
+    Type *I64Ty = IRB.getInt64Ty();
+    Value *Off = IRB.CreateShl(Page, Log2_64(ProtectedPageSize));
+    Value *Left = IRB.CreateSub(ConstantInt::get(I64Ty, Size), Off);
+    Value *PageSize = ConstantInt::get(I64Ty, ProtectedPageSize);
+    Value *Seed = IRB.CreateLoad(
+        I64Ty, IRB.CreateInBoundsGEP(SeedsGV->getValueType(), SeedsGV,
+                                     {ConstantInt::get(I64Ty, 0), Page}));
+    return IRB.CreateCall(
+        GetPageDecryptor(M),
+        {IRB.CreateGEP(IRB.getInt8Ty(), Start, Off),
+         IRB.CreateSelect(IRB.CreateICmpULT(Left, PageSize), Left, PageSize),
+         Seed,
+         IRB.CreateInBoundsGEP(StatusGV->getValueType(), StatusGV,
+                               {ConstantInt::get(I64Ty, 0), Page})});
+  }
+
+  // i1 StringPagesDecrypt(i64 first, i64 last) for the protected string at
+  // Start: decrypts its pages first to last, waiting for those another
+  // thread is decrypting. Returns false when a page cannot be decrypted.
+  Function *CreatePagesDecrypt(Module *M, Constant *Start, uint64_t Size,
+                               GlobalVariable *SeedsGV,
+                               GlobalVariable *StatusGV) {
+    LLVMContext &Ctx = M->getContext();
+    Type *I32Ty = Type::getInt32Ty(Ctx);
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    Function *F = Function::Create(
+        FunctionType::get(Type::getInt1Ty(Ctx), {I64Ty, I64Ty}, false),
+        GlobalValue::LinkageTypes::PrivateLinkage, "StringPagesDecrypt", M);
+    F->addFnAttr(Attribute::NoUnwind);
+    genedfunc.insert(F);
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "", F);
+    BasicBlock *Loop = BasicBlock::Create(Ctx, "DecryptPages", F);
+    BasicBlock *Wait = BasicBlock::Create(Ctx, "WaitForPage", F);
+    BasicBlock *Next = BasicBlock::Create(Ctx, "NextPage", F);
+    BasicBlock *Done = BasicBlock::Create(Ctx, "PagesDone", F);
+    BasicBlock *Failed = BasicBlock::Create(Ctx, "PagesFailed", F);
+    IRBuilder<> IRB(Entry);
+    IRB.CreateBr(Loop);
+
+    IRB.SetInsertPoint(Loop);
+    PHINode *Page = IRB.CreatePHI(I64Ty, 3);
+    Value *Result =
+        CallPageDecryptor(IRB, Start, Size, SeedsGV, StatusGV, Page);
+    SwitchInst *SI = IRB.CreateSwitch(Result, Next, 2);
+    SI->addCase(IRB.getInt32(0), Failed);
+    SI->addCase(IRB.getInt32(2), Wait);
+    IRB.SetInsertPoint(Wait);
+    IRB.CreateCall(M->getOrInsertFunction("sched_yield",
+                                          FunctionType::get(I32Ty, false)));
+    IRB.CreateBr(Loop);
+    IRB.SetInsertPoint(Next);
+    Value *NextPage = IRB.CreateAdd(Page, ConstantInt::get(I64Ty, 1));
+    IRB.CreateCondBr(IRB.CreateICmpULE(NextPage, F->getArg(1)), Loop, Done);
+    Page->addIncoming(F->getArg(0), Entry);
+    Page->addIncoming(Page, Wait);
+    Page->addIncoming(NextPage, Next);
+
+    IRB.SetInsertPoint(Done);
+    IRB.CreateRet(ConstantInt::getTrue(Ctx));
+    IRB.SetInsertPoint(Failed);
+    IRB.CreateRet(ConstantInt::getFalse(Ctx));
+    return F;
+  }
+
+  // void StringPagesForKernel(i8 *buf, i64 len): decrypts the pages of the
+  // protected strings overlapping buf to buf + len. Each protected string
+  // appends a block to it.
+  void CreateKernelBufferHook(Module *M) {
+    LLVMContext &Ctx = M->getContext();
+    pagekernel = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx),
+                          {Type::getInt8PtrTy(Ctx), Type::getInt64Ty(Ctx)},
+                          false),
+        GlobalValue::LinkageTypes::PrivateLinkage, "StringPagesForKernel", M);
+    pagekernel->addFnAttr(Attribute::NoUnwind);
+    genedfunc.insert(pagekernel);
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "", pagekernel);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "", pagekernel);
+    ReturnInst::Create(Ctx, Exit);
+    pagekerneltail = BranchInst::Create(Exit, Entry);
+  }
+
+  // Calls to the functions below hand a buffer straight to the kernel, so
+  // StringPagesForKernel decrypts the protected pages in it first. Other
+  // calls reaching the kernel, e.g. writev or those made from other object
+  // files, still fail with EFAULT on protected pages not touched yet.
+  void HookKernelBuffers(Module &M) {
+    // Buffer argument, length argument, and the argument the length is
+    // multiplied by, 0 if none
+    static const struct {
+      const char *Name;
+      unsigned Buf, Len, Count;
+    } Calls[] = {{"write", 1, 2, 0},  {"pwrite", 1, 2, 0},
+                 {"pwrite64", 1, 2, 0}, {"send", 1, 2, 0},
+                 {"sendto", 1, 2, 0}, {"fwrite", 0, 1, 2},
+                 {"fwrite_unlocked", 0, 1, 2}};
+    Type *I64Ty = Type::getInt64Ty(M.getContext());
+    Type *I8PtrTy = Type::getInt8PtrTy(M.getContext());
+    for (Function &F : M) {
+      if (genedfunc.count(&F))
+        continue;
+      for (Instruction &I : instructions(F)) {
+        CallBase *CB = dyn_cast<CallBase>(&I);
+        Function *Callee = CB ? CB->getCalledFunction() : nullptr;
+        if (!Callee)
+          continue;
+        for (const auto &C : Calls) {
+          if (Callee->getName() != C.Name)
+            continue;
+          if (CB->arg_size() <= std::max({C.Buf, C.Len, C.Count}))
+            break;
+          Value *Buf = CB->getArgOperand(C.Buf);
+          Value *Len = CB->getArgOperand(C.Len);
+          Value *Count = CB->getArgOperand(C.Count);
+          if (!Buf->getType()->isPointerTy() ||
+              !Len->getType()->isIntegerTy() ||
+              (C.Count && !Count->getType()->isIntegerTy()))
+            break;
+          IRBuilder<> IRB(CB);
+          Len = IRB.CreateZExtOrTrunc(Len, I64Ty);
+          if (C.Count)
+            Len = IRB.CreateMul(Len, IRB.CreateZExtOrTrunc(Count, I64Ty));
+          IRB.CreateCall(pagekernel,
+                         {IRB.CreatePointerBitCastOrAddrSpaceCast(Buf, I8PtrTy),
+                          Len});
+          break;
+        }
+      }
+    }
+  }
+
+  // void StringPageFaultHandler(i32 sig, siginfo_t *info, void *ctx), and
+  // the constructor installing it. Faults outside the protected strings, or
+  // on pages that could not be decrypted, go to the handler that was
+  // installed before, or restore it when that was the default action so the
+  // access faults again and kills the process as usual. A handler installed
+  // after this one has to chain to it, or the protected strings fault.
+  void CreatePageFaultHandler(Module *M) {
+    LLVMContext &Ctx = M->getContext();
+    Type *VoidTy = Type::getVoidTy(Ctx);
+    Type *I32Ty = Type::getInt32Ty(Ctx);
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    Type *I8PtrTy = Type::getInt8PtrTy(Ctx);
+    // struct sigaction: handler, sa_mask, sa_flags, sa_restorer
+    StructType *SigActionTy = StructType::get(
+        Ctx, {I8PtrTy, ArrayType::get(I64Ty, 16), I32Ty, I8PtrTy});
+    FunctionType *SigInfoHandlerTy =
+        FunctionType::get(VoidTy, {I32Ty, I8PtrTy, I8PtrTy}, false);
+    FunctionType *HandlerTy = FunctionType::get(VoidTy, {I32Ty}, false);
+    FunctionCallee SigAction = M->getOrInsertFunction(
+        "sigaction", I32Ty, I32Ty, SigActionTy->getPointerTo(),
+        SigActionTy->getPointerTo());
+    pagehandler = Function::Create(SigInfoHandlerTy,
+                                   GlobalValue::LinkageTypes::PrivateLinkage,
+                                   "StringPageFaultHandler", M);
+    pagehandler->addFnAttr(Attribute::NoInline);
+    pagehandler->addFnAttr(Attribute::NoUnwind);
+    genedfunc.insert(pagehandler);
+    GlobalVariable *OldGV = new GlobalVariable(
+        *M, SigActionTy, false, GlobalValue::LinkageTypes::PrivateLinkage,
+        Constant::getNullValue(SigActionTy), "StringPageOldAction");
+    genedgv.insert(OldGV);
+
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "", pagehandler);
+    IRBuilder<> IRB(Entry);
+    pagehandlerfallback =
+        BasicBlock::Create(Ctx, "ChainFault", pagehandler);
+    pagehandlertail = IRB.CreateBr(pagehandlerfallback);
+
+    BasicBlock *SigInfo = BasicBlock::Create(Ctx, "", pagehandler);
+    BasicBlock *Plain = BasicBlock::Create(Ctx, "", pagehandler);
+    BasicBlock *Call = BasicBlock::Create(Ctx, "", pagehandler);
+    BasicBlock *Restore = BasicBlock::Create(Ctx, "", pagehandler);
+    IRB.SetInsertPoint(pagehandlerfallback);
+    Value *Old = IRB.CreateLoad(I8PtrTy, IRB.CreateStructGEP(SigActionTy,
+                                                              OldGV, 0));
+    Value *Flags =
+        IRB.CreateLoad(I32Ty, IRB.CreateStructGEP(SigActionTy, OldGV, 2));
+    IRB.CreateCondBr(
+        IRB.CreateICmpNE(IRB.CreateAnd(Flags, SaSigInfo),
+                         ConstantInt::get(I32Ty, 0)),
+        SigInfo, Plain);
+    IRB.SetInsertPoint(SigInfo);
+    IRB.CreateCall(SigInfoHandlerTy,
+                   IRB.CreatePointerCast(Old, SigInfoHandlerTy->getPointerTo()),
+                   {pagehandler->getArg(0), pagehandler->getArg(1),
+                    pagehandler->getArg(2)});
+    IRB.CreateRetVoid();
+    // SIG_DFL is 0 and SIG_IGN is 1
+    IRB.SetInsertPoint(Plain);
+    IRB.CreateCondBr(IRB.CreateICmpUGT(IRB.CreatePtrToInt(Old, I64Ty),
+                                       ConstantInt::get(I64Ty, 1)),
+                     Call, Restore);
+    IRB.SetInsertPoint(Call);
+    IRB.CreateCall(HandlerTy,
+                   IRB.CreatePointerCast(Old, HandlerTy->getPointerTo()),
+                   {pagehandler->getArg(0)});
+    IRB.CreateRetVoid();
+    IRB.SetInsertPoint(Restore);
+    IRB.CreateCall(SigAction,
+                   {ConstantInt::get(I32Ty, SigSegv), OldGV,
+                    Constant::getNullValue(SigActionTy->getPointerTo())});
+    IRB.CreateRetVoid();
+
+    Function *Init = Function::Create(
+        FunctionType::get(VoidTy, ArrayRef<Type *>(), false),
+        GlobalValue::LinkageTypes::PrivateLinkage, "StringPageFaultInit", M);
+    genedfunc.insert(Init);
+    GlobalVariable *NewGV = new GlobalVariable(
+        *M, SigActionTy, true, GlobalValue::LinkageTypes::PrivateLinkage,
+        ConstantStruct::get(
+            SigActionTy,
+            {ConstantExpr::getPointerCast(pagehandler, I8PtrTy),
+             Constant::getNullValue(SigActionTy->getElementType(1)),
+             ConstantInt::get(I32Ty, SaSigInfo | SaRestart),
+             Constant::getNullValue(I8PtrTy)}),
+        "StringPageAction");
+    genedgv.insert(NewGV);
+    BasicBlock *InitEntry = BasicBlock::Create(Ctx, "", Init);
+    BasicBlock *InitEnd = BasicBlock::Create(Ctx, "", Init);
+    ReturnInst::Create(Ctx, InitEnd);
+    IRB.SetInsertPoint(InitEntry);
+    IRB.CreateCall(SigAction, {ConstantInt::get(I32Ty, SigSegv), NewGV, OldGV});
+    pageinittail = IRB.CreateBr(InitEnd);
+    // Nothing may read the strings before their pages are protected, so this
+    // takes the first priority available outside the implementation. Other
+    // constructors at that priority may run first and see them encrypted.
+    appendToGlobalCtors(*M, Init, 101);
+  }
+
+  // i32 StringPageDecrypt(i8 *page, i64 len, i64 seed, i32 *status)
+  // Decrypts the first len bytes of the protected page at page, claiming it
+  // in its status word first like emitStatusClaim does for whole strings.
+  // The page is moved away while being decrypted, so other threads touching
+  // it fault and retry instead of reading it half decrypted. Never blocks:
+  // returns 1 once the page is decrypted, 2 while another thread is
+  // decrypting it, and 0, with the page left encrypted where possible, when
+  // a mapping call fails.
+  Function *GetPageDecryptor(Module *M) {
+    if (pagedecryptor)
+      return pagedecryptor;
+    LLVMContext &Ctx = M->getContext();
+    Type *I8Ty = Type::getInt8Ty(Ctx);
+    Type *I32Ty = Type::getInt32Ty(Ctx);
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    Type *I8PtrTy = Type::getInt8PtrTy(Ctx);
+    Function *F = Function::Create(
+        FunctionType::get(I32Ty,
+                          {I8PtrTy, I64Ty, I64Ty, I32Ty->getPointerTo()},
+                          false),
+        GlobalValue::LinkageTypes::PrivateLinkage, "StringPageDecrypt", M);
+    F->addFnAttr(Attribute::NoInline);
+    F->addFnAttr(Attribute::NoUnwind);
+    genedfunc.insert(F);
+    Value *Page = F->getArg(0);
+    Value *Len = F->getArg(1);
+    Value *Seed = F->getArg(2);
+    Value *Status = F->getArg(3);
+    Constant *Encrypted = ConstantInt::get(I32Ty, 0);
+    Constant *Ready = ConstantInt::get(I32Ty, 1);
+    Constant *Decrypting = ConstantInt::get(I32Ty, 2);
+    FunctionCallee MMap = M->getOrInsertFunction(
+        "mmap", I8PtrTy, I8PtrTy, I64Ty, I32Ty, I32Ty, I32Ty, I64Ty);
+    FunctionCallee MRemap = M->getOrInsertFunction(
+        "mremap",
+        FunctionType::get(I8PtrTy, {I8PtrTy, I64Ty, I64Ty, I32Ty}, true));
+    FunctionCallee MProtect =
+        M->getOrInsertFunction("mprotect", I32Ty, I8PtrTy, I64Ty, I32Ty);
+    FunctionCallee MUnmap =
+        M->getOrInsertFunction("munmap", I32Ty, I8PtrTy, I64Ty);
+    Value *PageSize = ConstantInt::get(I64Ty, ProtectedPageSize);
+    // MAP_FAILED
+    Constant *MapFailed = ConstantExpr::getIntToPtr(
+        ConstantInt::get(I64Ty, -1), I8PtrTy);
+
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "", F);
+    BasicBlock *Claim = BasicBlock::Create(Ctx, "ClaimPage", F);
+    BasicBlock *Taken = BasicBlock::Create(Ctx, "PageTaken", F);
+    BasicBlock *Move = BasicBlock::Create(Ctx, "MovePage", F);
+    BasicBlock *MoveAway = BasicBlock::Create(Ctx, "MovePageAway", F);
+    BasicBlock *Unprotect = BasicBlock::Create(Ctx, "UnprotectPage", F);
+    BasicBlock *FreeScratch = BasicBlock::Create(Ctx, "FreeScratch", F);
+    BasicBlock *PutBack = BasicBlock::Create(Ctx, "PutPageBack", F);
+    BasicBlock *Loop = BasicBlock::Create(Ctx, "DecryptPage", F);
+    BasicBlock *Back = BasicBlock::Create(Ctx, "RestorePage", F);
+    BasicBlock *MarkDone = BasicBlock::Create(Ctx, "MarkPageDone", F);
+    BasicBlock *Fail = BasicBlock::Create(Ctx, "PageFailed", F);
+    BasicBlock *Done = BasicBlock::Create(Ctx, "PageDone", F);
+    IRBuilder<> IRB(Entry);
+    LoadInst *Seen = IRB.CreateLoad(I32Ty, Status);
+    Seen->setAtomic(AtomicOrdering::Acquire);
+    Seen->setAlignment(Align(4));
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Seen, Ready), Done, Claim);
+
+    IRB.SetInsertPoint(Claim);
+    AtomicCmpXchgInst *CAS = IRB.CreateAtomicCmpXchg(
+        Status, Encrypted, Decrypting, MaybeAlign(4), AtomicOrdering::Acquire,
+        AtomicOrdering::Acquire);
+    IRB.CreateCondBr(IRB.CreateExtractValue(CAS, 1), Move, Taken);
+    // Another thread either finished the page meanwhile or is still on it
+    IRB.SetInsertPoint(Taken);
+    Value *Other = IRB.CreateExtractValue(CAS, 0);
+    IRB.CreateRet(IRB.CreateSelect(IRB.CreateICmpEQ(Other, Ready), Ready,
+                                   Decrypting));
+
+    IRB.SetInsertPoint(Move);
+    Value *Scratch = IRB.CreateCall(
+        MMap, {Constant::getNullValue(I8PtrTy), PageSize,
+               ConstantInt::get(I32Ty, ProtNone),
+               ConstantInt::get(I32Ty, MapPrivateAnonymous),
+               ConstantInt::get(I32Ty, -1), ConstantInt::get(I64Ty, 0)});
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Scratch, MapFailed), Fail, MoveAway);
+    IRB.SetInsertPoint(MoveAway);
+    Value *Moved = IRB.CreateCall(
+        MRemap, {Page, PageSize, PageSize,
+                 ConstantInt::get(I32Ty, MRemapMayMoveFixed), Scratch});
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Moved, MapFailed), FreeScratch,
+                     Unprotect);
+    IRB.SetInsertPoint(FreeScratch);
+    IRB.CreateCall(MUnmap, {Scratch, PageSize});
+    IRB.CreateBr(Fail);
+    IRB.SetInsertPoint(Unprotect);
+    Value *Unprotected = IRB.CreateCall(
+        MProtect,
+        {Scratch, PageSize, ConstantInt::get(I32Ty, ProtReadWrite)});
+    IRB.CreateCondBr(IRB.CreateICmpNE(Unprotected, Encrypted), PutBack, Loop);
+    IRB.SetInsertPoint(PutBack);
+    IRB.CreateCall(MRemap, {Scratch, PageSize, PageSize,
+                            ConstantInt::get(I32Ty, MRemapMayMoveFixed),
+                            Page});
+    IRB.CreateBr(Fail);
+
+    // Same keystream as HandlePageProtection, one byte per step
+    IRB.SetInsertPoint(Loop);
+    PHINode *Idx = IRB.CreatePHI(I64Ty, 2);
+    PHINode *State = IRB.CreatePHI(I64Ty, 2, "KeystreamState");
+    Value *S = State;
+    S = IRB.CreateXor(S, IRB.CreateShl(S, 13));
+    S = IRB.CreateXor(S, IRB.CreateLShr(S, 7));
+    S = IRB.CreateXor(S, IRB.CreateShl(S, 17));
+    Value *Ptr = IRB.CreateGEP(I8Ty, Scratch, Idx);
+    IRB.CreateStore(
+        IRB.CreateXor(IRB.CreateLoad(I8Ty, Ptr), IRB.CreateTrunc(S, I8Ty)),
+        Ptr);
+    Value *Next = IRB.CreateAdd(Idx, ConstantInt::get(I64Ty, 1));
+    IRB.CreateCondBr(IRB.CreateICmpULT(Next, Len), Loop, Back);
+    Idx->addIncoming(ConstantInt::get(I64Ty, 0), Unprotect);
+    Idx->addIncoming(Next, Loop);
+    State->addIncoming(Seed, Unprotect);
+    State->addIncoming(S, Loop);
+
+    IRB.SetInsertPoint(Back);
+    Value *Restored = IRB.CreateCall(
+        MRemap, {Scratch, PageSize, PageSize,
+                 ConstantInt::get(I32Ty, MRemapMayMoveFixed), Page});
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Restored, MapFailed), Fail, MarkDone);
+    IRB.SetInsertPoint(MarkDone);
+    StoreInst *SI = IRB.CreateStore(Ready, Status);
+    SI->setAtomic(AtomicOrdering::Release);
+    SI->setAlignment(Align(4));
+    IRB.CreateBr(Done);
+    // Release the claim, so that a later access tries again
+    IRB.SetInsertPoint(Fail);
+    SI = IRB.CreateStore(Encrypted, Status);
+    SI->setAtomic(AtomicOrdering::Release);
+    SI->setAlignment(Align(4));
+    IRB.CreateRet(Encrypted);
+
+    IRB.SetInsertPoint(Done);
+    IRB.CreateRet(Ready);
+    pagedecryptor = F;
+    return F;
+  }
 };
 
 ModulePass *createStringEncryptionPass(bool flag) {
@@ -67,6 +67,7 @@ struct Substitution : public FunctionPass {
     // Do we obfuscate
     if (toObfuscate(flag, tmp, "sub")) {
       errs() << "Running Instruction Substitution On " << F.getName() << "\n";
+      CryptoStream CS(F.getName(), "sub");
       substitute(tmp);
       return true;
     }
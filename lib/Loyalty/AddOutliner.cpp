@@ -1,55 +1,90 @@
 #include "AddOutliner.h"
+#include "CryptoUtils.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 using namespace llvm;
 
+static cl::opt<uint32_t> OutlineVariants(
+    "outline-variants", cl::init(1), cl::NotHidden,
+    cl::desc("Number of outlined functions -enable-outline creates for each "
+             "distinct operation"));
+
 namespace llvm {
 
+// Returns the function computing operations shaped like I, creating it
+// the first time. With -outline-variants above 1 each shape gets that many
+// interchangeable copies, picked at random per call site.
+Function *OutlineVisitor::getOutlinedFunction(BinaryOperator &I) {
+  unsigned Flags = 0;
+  if (isa<OverflowingBinaryOperator>(I))
+    Flags |= I.hasNoUnsignedWrap() | I.hasNoSignedWrap() << 1;
+  if (isa<PossiblyExactOperator>(I))
+    Flags |= I.isExact() << 2;
+  unsigned Variant = OutlineVariants > 1
+                         ? cryptoutils->get_range(OutlineVariants)
+                         : 0;
+  OutlineKey Key(I.getModule(), I.getOpcode(), I.getType(), Flags, Variant);
+  auto It = Cache.find(Key);
+  if (It != Cache.end() && It->second)
+    return cast<Function>(It->second);
+
+  IntegerType *IntTy = cast<IntegerType>(I.getType());
+  SmallVector<Type *, 8> types{IntTy, IntTy};
+  FunctionType *outlineFt =
+      FunctionType::get(IntTy, ArrayRef<Type *>(types), false);
+  Function *func =
+      Function::Create(outlineFt, GlobalValue::LinkageTypes::InternalLinkage,
+                       "Outliner", I.getModule());
+  func->setCallingConv(CallingConv::Fast);
+
+  LLVMContext &ctx = func->getContext();
+  BasicBlock *BB = BasicBlock::Create(ctx, "", func);
+  IRBuilder<> builder(BB);
+
+  Value *Arg1 = func->getArg(0);
+  Value *Arg2 = func->getArg(1);
+  Instruction *II = I.clone();
+  II->setOperand(0, Arg1);
+  II->setOperand(1, Arg2);
+  // The location belongs to the first caller, not to the shared function
+  II->setDebugLoc(DebugLoc());
+  Value *sum = builder.Insert(II);
+  builder.CreateRet(sum);
+
+  // attach metadata to prevent instvisitor looping forever
+  LLVMContext &C = sum->getContext();
+  MDNode *N = MDNode::get(C, MDString::get(C, "isoutlined"));
+  cast<Instruction>(sum)->setMetadata("outlined", N);
+
+  Cache[Key] = func;
+  return func;
+}
+
 void OutlineVisitor::visitBinaryOperator(BinaryOperator &I) {
   Type *ITy = I.getType();
 
   if (IntegerType::classof(ITy) && !I.getMetadata("outlined")) {
-    IntegerType *IntTy = static_cast<IntegerType *>(ITy);
-
-    SmallVector<Type *, 8> types{IntTy, IntTy};
-    FunctionType *outlineFt =
-        FunctionType::get(IntTy, ArrayRef<Type *>(types), false);
-    Function *func =
-        Function::Create(outlineFt, GlobalValue::LinkageTypes::ExternalLinkage,
-                         "Outliner", I.getModule());
-
-    LLVMContext &ctx = func->getContext();
-    BasicBlock *BB = BasicBlock::Create(ctx, "", func);
-    IRBuilder<> builder(BB);
-
-    Value *Arg1 = func->getArg(0);
-    Value *Arg2 = func->getArg(1);
-    Instruction *II = I.clone();
-    II->setOperand(0, Arg1);
-    II->setOperand(1, Arg2);
-    Value *sum = builder.Insert(II);
-    builder.CreateRet(sum);
-
-    // attach metadata to prevent instvisitor looping forever
-    LLVMContext &C = sum->getContext();
-    MDNode *N = MDNode::get(C, MDString::get(C, "isoutlined"));
-    cast<Instruction>(sum)->setMetadata("outlined", N);
+    Function *func = getOutlinedFunction(I);
 
     SmallVector<Value *, 8> params;
     params.emplace_back(I.getOperand(0));
     params.emplace_back(I.getOperand(1));
-    Instruction *replace =
-        CallInst::Create(outlineFt, func, ArrayRef<Value *>(params));
+    CallInst *replace = CallInst::Create(func->getFunctionType(), func,
+                                         ArrayRef<Value *>(params));
+    replace->setCallingConv(CallingConv::Fast);
+    replace->setDebugLoc(I.getDebugLoc());
     ReplaceInstWithInst(cast<Instruction>(&I), replace);
   }
 }
 
 PreservedAnalyses OutlinerPass::run(Function &F, FunctionAnalysisManager &FAM) {
-  OutlineVisitor *V = new OutlineVisitor();
+  CryptoStream CS(F.getName(), "outline");
+  OutlineVisitor V(Cache);
 
-  V->visit(F);
+  V.visit(F);
 
   return PreservedAnalyses::none();
 }
@@ -1,21 +1,34 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/IR/ValueHandle.h"
+#include <map>
+#include <tuple>
 
 namespace llvm {
 
+// (module, opcode, type, nuw/nsw/exact flags, variant) of an outlined
+// operation
+using OutlineKey = std::tuple<Module *, unsigned, Type *, unsigned, unsigned>;
 
 struct OutlineVisitor : public InstVisitor<OutlineVisitor> {
+  std::map<OutlineKey, WeakVH> &Cache;
 
+  OutlineVisitor(std::map<OutlineKey, WeakVH> &Cache) : Cache(Cache) {}
   void visitBinaryOperator(BinaryOperator &I);
+  Function *getOutlinedFunction(BinaryOperator &I);
 };
 
 
 class OutlinerPass : public PassInfoMixin<OutlinerPass> {
+  // Structurally identical operations share their outlined function. The
+  // pass outlives the functions it creates, which later passes may inline
+  // and delete, so entries are nulled when their function goes away.
+  std::map<OutlineKey, WeakVH> Cache;
 
 public:
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
   static bool isRequired() { return true; }
 };
 
-} // namespace llvm
\ No newline at end of file
+} // namespace llvm
@@ -4,51 +4,131 @@
 #include "CryptoUtils.h"
 #include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 #include <chrono>
+#include <cstring>
 
 using namespace llvm;
 namespace llvm {
 ManagedStatic<CryptoUtils> cryptoutils;
 }
+
+// SplitMix64 finalizer. Output N of a stream is mix(Key + N * Golden), so a
+// stream is fully described by its key and how far it has been consumed.
+static const std::uint_fast64_t Golden = 0x9E3779B97F4A7C15ULL;
+static inline uint64_t mix(uint64_t Z) {
+  Z = (Z ^ (Z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  Z = (Z ^ (Z >> 27)) * 0x94D049BB133111EBULL;
+  return Z ^ (Z >> 31);
+}
+
+namespace {
+struct StreamState {
+  std::uint_fast64_t Key = 0;
+  std::uint_fast64_t Ctr = 0;
+  bool Keyed = false;
+};
+} // namespace
+static thread_local StreamState Stream;
+
 CryptoUtils::CryptoUtils() {}
 
-uint32_t
-CryptoUtils::scramble32(uint32_t in,
-                        std::map<uint32_t /*IDX*/, uint32_t /*VAL*/> &VMap) {
-  if (VMap.find(in) == VMap.end()) {
-    uint32_t V = get_uint32_t();
-    VMap[in] = V;
-    return V;
-  } else {
-    return VMap[in];
+void CryptoUtils::scramble_key(ScrambleKey &Key, uint32_t Range) {
+  for (uint32_t &R : Key.Round)
+    R = get_uint32_t();
+  Key.Range = Range;
+  Key.Base = 0;
+  Key.HalfBits = 16;
+  if (Range) {
+    Key.HalfBits = 1;
+    while (Key.HalfBits < 16 && (1ULL << (2 * Key.HalfBits)) < Range)
+      ++Key.HalfBits;
+    Key.Base = get_range(UINT32_MAX - Range);
   }
 }
-CryptoUtils::~CryptoUtils() {
-  if (eng != nullptr)
-    delete eng;
+
+uint32_t CryptoUtils::scramble32(uint32_t in, const ScrambleKey &Key) {
+  assert((!Key.Range || in < Key.Range) && "scramble32 index out of range");
+  const uint32_t Mask = (1U << Key.HalfBits) - 1;
+  uint32_t V = in;
+  do {
+    uint32_t L = V >> Key.HalfBits, R = V & Mask;
+    for (uint32_t K : Key.Round) {
+      uint32_t F = R * 0x9E3779B1U + K;
+      F ^= F >> 15;
+      F *= 0x85EBCA77U;
+      F ^= F >> 13;
+      uint32_t T = L ^ (F & Mask);
+      L = R;
+      R = T;
+    }
+    V = (L << Key.HalfBits) | R;
+  } while (Key.Range && V >= Key.Range);
+  return Key.Base + V;
 }
+CryptoUtils::~CryptoUtils() {}
 void CryptoUtils::prng_seed() {
   using namespace std::chrono;
   std::uint_fast64_t ms =
       duration_cast<milliseconds>(system_clock::now().time_since_epoch())
           .count();
-  errs() << format("std::mt19937_64 seeded with current timestamp: %" PRIu64 "",
+  errs() << format("CryptoUtils seeded with current timestamp: %" PRIu64 "",
                    ms)
          << "\n";
-  eng = new std::mt19937_64(ms);
+  seed = ms;
+  seeded = true;
+  Stream = {mix(seed), 0, true};
 }
 void CryptoUtils::prng_seed(std::uint_fast64_t seed) {
-  errs() << format("std::mt19937_64 seeded with: %" PRIu64 "", seed) << "\n";
-  eng = new std::mt19937_64(seed);
+  errs() << format("CryptoUtils seeded with: %" PRIu64 "", seed) << "\n";
+  this->seed = seed;
+  seeded = true;
+  Stream = {mix(seed), 0, true};
 }
 std::uint_fast64_t CryptoUtils::get_raw() {
-  if (eng == nullptr)
+  if (!seeded)
     prng_seed();
-  return (*eng)();
+  if (!Stream.Keyed)
+    Stream = {mix(seed), 0, true};
+  return mix(Stream.Key + ++Stream.Ctr * Golden);
+}
+void CryptoUtils::get_bytes(uint8_t *Buf, size_t Len) {
+  while (Len >= sizeof(uint64_t)) {
+    uint64_t V = get_raw();
+    memcpy(Buf, &V, sizeof(V));
+    Buf += sizeof(V);
+    Len -= sizeof(V);
+  }
+  if (Len) {
+    uint64_t V = get_raw();
+    memcpy(Buf, &V, Len);
+  }
 }
 uint32_t CryptoUtils::get_range(uint32_t min, uint32_t max) {
-  if (max == 0)
-    return 0;
-  std::uniform_int_distribution<uint32_t> dis(min, max - 1);
-  return dis(*eng);
+  if (max <= min)
+    return min;
+  // Lemire's multiply-shift, rejecting the biased low products
+  uint32_t Range = max - min;
+  uint64_t M = (uint64_t)get_uint32_t() * Range;
+  if ((uint32_t)M < Range) {
+    uint32_t Threshold = -Range % Range;
+    while ((uint32_t)M < Threshold)
+      M = (uint64_t)get_uint32_t() * Range;
+  }
+  return min + (uint32_t)(M >> 32);
+}
+
+CryptoStream::CryptoStream(StringRef Name, StringRef PassID) {
+  if (!cryptoutils->seeded)
+    cryptoutils->prng_seed();
+  SavedKey = Stream.Keyed ? Stream.Key : mix(cryptoutils->seed);
+  SavedCtr = Stream.Keyed ? Stream.Ctr : 0;
+  Stream.Key =
+      mix(cryptoutils->seed ^ mix(xxHash64(Name) ^ mix(xxHash64(PassID))));
+  Stream.Ctr = 0;
+  Stream.Keyed = true;
+}
+CryptoStream::~CryptoStream() {
+  Stream.Key = SavedKey;
+  Stream.Ctr = SavedCtr;
 }
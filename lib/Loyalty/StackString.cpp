@@ -2,18 +2,86 @@
 #include "StackString.h"
 #include "CryptoUtils.h"
 #include "Utils.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/NoFolder.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/SwapByteOrder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 using namespace llvm;
 
+// Widest vector each stack string is built with, one SSE or NEON register
+static const unsigned StackStringChunk = 16;
+
+static cl::opt<uint32_t> StackStringMaxSize(
+    "sstring-max-size", cl::init(256), cl::NotHidden,
+    cl::desc("Strings larger than this many bytes are decrypted into a "
+             "global once instead of onto the stack by -enable-sstring"));
+
+static cl::opt<uint32_t> StackStringBudget(
+    "sstring-stack-budget", cl::init(1024), cl::NotHidden,
+    cl::desc("Bytes of stack strings -enable-sstring may add to a single "
+             "frame, the rest go to globals"));
+
+// Raw data is laid out for the host, stack strings for the target
+static std::string targetBytes(ConstantDataSequential *CDS,
+                               const DataLayout &DL) {
+  std::string Bytes = CDS->getRawDataValues().str();
+  const unsigned Width = CDS->getElementByteSize();
+  if (Width > 1 && DL.isBigEndian() != sys::IsBigEndianHost)
+    for (size_t i = 0; i < Bytes.size(); i += Width)
+      std::reverse(Bytes.begin() + i, Bytes.begin() + i + Width);
+  return Bytes;
+}
+
 namespace llvm {
 
+// Where to build the stack string replacing GV: before its first use in
+// the nearest common dominator of its uses, or at the end of that block
+// when none of them is in it. A PHI uses the string at the end of the
+// incoming block. Loops are left so the string is only built once.
+static Instruction *findInsertionPoint(GlobalVariable *GV, DominatorTree &DT,
+                                       LoopInfo &LI) {
+  SmallVector<Use *, 16> Worklist;
+  for (Use &U : GV->uses())
+    Worklist.emplace_back(&U);
+  SmallPtrSet<Instruction *, 16> UsePts;
+  BasicBlock *Dom = nullptr;
+  while (!Worklist.empty()) {
+    Use *U = Worklist.pop_back_val();
+    if (isa<ConstantExpr>(U->getUser())) {
+      for (Use &CEU : U->getUser()->uses())
+        Worklist.emplace_back(&CEU);
+      continue;
+    }
+    Instruction *I = cast<Instruction>(U->getUser());
+    if (PHINode *PN = dyn_cast<PHINode>(I))
+      I = PN->getIncomingBlock(*U)->getTerminator();
+    // Nothing needs to be built for code that never runs
+    if (!DT.isReachableFromEntry(I->getParent()))
+      continue;
+    UsePts.insert(I);
+    Dom = Dom ? DT.findNearestCommonDominator(Dom, I->getParent())
+              : I->getParent();
+  }
+  if (!Dom)
+    return &*DT.getRoot()->getFirstInsertionPt();
+  if (Loop *L = LI.getLoopFor(Dom)) {
+    while (L->getParentLoop())
+      L = L->getParentLoop();
+    return DT.getNode(L->getHeader())->getIDom()->getBlock()->getTerminator();
+  }
+  for (Instruction &I : *Dom)
+    if (UsePts.count(&I))
+      return &I;
+  return Dom->getTerminator();
+}
+
 bool StackStringPass::handleableGV(GlobalVariable *GV) {
   return GV->hasInitializer() && !GV->getSection().startswith("llvm.") &&
          !(GV->getSection().contains("__objc") &&
@@ -90,6 +158,7 @@ void StackStringPass::processArrayMembers(
 }
 
 void StackStringPass::HandleFunction(Function *Func) {
+  CryptoStream CS(Func->getName(), "sstring");
   FixFunctionConstantExpr(Func);
   SmallVector<GlobalVariable *, 32> Globals;
   std::set<User *> Users;
@@ -158,45 +227,119 @@ void StackStringPass::HandleFunction(Function *Func) {
     } // foreach loop
   } while (transedGlobals.size() != Globals.size());
 
+  // A stack string only exists in this frame, so anything another global
+  // points to is left alone
+  SmallVector<GlobalVariable *, 16> StackStrings;
   for (GlobalVariable *GV : rawStrings) {
     if (GV->getInitializer()->isZeroValue() ||
         GV->getInitializer()->isNullValue())
       continue;
     ConstantDataSequential *CDS =
         cast<ConstantDataSequential>(GV->getInitializer());
-    Type *ElementTy = CDS->getElementType();
-    if (!ElementTy->isIntegerTy()) {
+    if (!CDS->getElementType()->isIntegerTy() || !onlyUsedIn(GV, Func))
+      continue;
+    StackStrings.emplace_back(GV);
+  }
+  if (StackStrings.empty())
+    return;
+
+  // Strings too large for the stack, or past the budget of the function,
+  // are decrypted once into a global instead. Smallest first, so that the
+  // budget covers as many strings as possible.
+  const DataLayout &DL = M->getDataLayout();
+  auto SizeOf = [&](GlobalVariable *GV) -> uint64_t {
+    return DL.getTypeAllocSize(GV->getValueType());
+  };
+  llvm::stable_sort(StackStrings, [&](GlobalVariable *L, GlobalVariable *R) {
+    return std::make_pair(SizeOf(L), L->getName()) <
+           std::make_pair(SizeOf(R), R->getName());
+  });
+  SmallVector<GlobalVariable *, 16> GlobalStrings;
+  uint64_t StackUsed = 0;
+  for (auto It = StackStrings.begin(); It != StackStrings.end();) {
+    const uint64_t Size = SizeOf(*It);
+    if (Size > StackStringMaxSize || StackUsed + Size > StackStringBudget) {
+      GlobalStrings.emplace_back(*It);
+      It = StackStrings.erase(It);
       continue;
     }
-    IntegerType *intType = cast<IntegerType>(ElementTy);
-
-    BasicBlock *A = &(Func->getEntryBlock());
-    BasicBlock *C = A->splitBasicBlock(A->getFirstNonPHIOrDbgOrLifetime());
-    C->setName("PrecedingBlock");
-    BasicBlock *B =
-        BasicBlock::Create(Func->getContext(), "StringDecryptionBB", Func, C);
-
-    // Change A's terminator to jump to B
-    BranchInst *newBr = BranchInst::Create(B);
-    ReplaceInstWithInst(A->getTerminator(), newBr);
-
-    // Prepare new stack string
-    IRBuilder<> builder(B);
-    Value *StackString = builder.CreateAlloca(CDS->getType());
-
-    for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-      Value *zero = ConstantInt::get(Type::getInt64Ty(B->getContext()), 0);
-      const uint64_t K = cryptoutils->get_uint64_t();
-      const uint64_t V = CDS->getElementAsInteger(i);
-      Value *offset = ConstantInt::get(Type::getInt64Ty(B->getContext()), i);
-      Value *StackStringItr =
-          builder.CreateGEP(CDS->getType(), StackString, {zero, offset});
-      Value *chr = ConstantInt::get(ElementTy, K);
-      builder.CreateStore(chr, StackStringItr);
-      Value *key = ConstantInt::get(ElementTy, K ^ V);
-      LoadInst *LI = builder.CreateLoad(CDS->getElementType(), StackStringItr);
-      Value *XORed = builder.CreateXor(LI, key);
-      builder.CreateStore(XORed, StackStringItr);
+    StackUsed += Size;
+    ++It;
+  }
+
+  // Pick every insertion point before touching the function
+  DominatorTree DT(*Func);
+  LoopInfo LI(DT);
+  std::vector<Instruction *> InsertPts, GlobalInsertPts;
+  for (GlobalVariable *GV : StackStrings)
+    InsertPts.emplace_back(findInsertionPoint(GV, DT, LI));
+  for (GlobalVariable *GV : GlobalStrings)
+    GlobalInsertPts.emplace_back(findInsertionPoint(GV, DT, LI));
+  // Nothing may come between a musttail call and its ret, so lifetimes end
+  // before the call there
+  SmallVector<Instruction *, 8> Exits;
+  for (BasicBlock &BB : *Func) {
+    if (CallInst *MustTail = BB.getTerminatingMustTailCall())
+      Exits.emplace_back(MustTail);
+    else if (isa<ReturnInst>(BB.getTerminator()) ||
+             isa<ResumeInst>(BB.getTerminator()))
+      Exits.emplace_back(BB.getTerminator());
+  }
+
+  // Allocas stay in the entry block so they remain static
+  IRBuilder<> allocaBuilder(&*Func->getEntryBlock().getFirstInsertionPt());
+  SmallVector<AllocaInst *, 16> Allocas;
+  for (GlobalVariable *GV : StackStrings) {
+    AllocaInst *StackString =
+        allocaBuilder.CreateAlloca(GV->getInitializer()->getType());
+    StackString->setAlignment(
+        std::max(StackString->getAlign(), Align(StackStringChunk)));
+    Allocas.emplace_back(StackString);
+  }
+  for (unsigned S = 0; S < StackStrings.size(); S++) {
+    GlobalVariable *GV = StackStrings[S];
+    ConstantDataSequential *CDS =
+        cast<ConstantDataSequential>(GV->getInitializer());
+    AllocaInst *StackString = Allocas[S];
+    // The slot is only live from where the string is built, so the
+    // backend may share it with strings built on other paths
+    ConstantInt *AllocSize =
+        ConstantInt::get(Type::getInt64Ty(Func->getContext()),
+                         DL.getTypeAllocSize(CDS->getType()));
+    IRBuilder<> builder(InsertPts[S]);
+    builder.CreateLifetimeStart(StackString, AllocSize);
+    for (Instruction *Exit : Exits)
+      IRBuilder<>(Exit).CreateLifetimeEnd(StackString, AllocSize);
+
+    std::string Plain = targetBytes(CDS, DL);
+
+    // Store a random key, load it back and XOR in the encrypted data,
+    // StackStringChunk bytes at a time and then halving for the tail
+    Value *Base = builder.CreatePointerCast(
+        StackString, builder.getInt8PtrTy(StackString->getAddressSpace()));
+    for (size_t Off = 0, ChunkSize = StackStringChunk; Off < Plain.size();) {
+      if (Off + ChunkSize > Plain.size()) {
+        ChunkSize /= 2;
+        continue;
+      }
+      SmallVector<uint8_t, StackStringChunk> Key(ChunkSize),
+          Encrypted(ChunkSize);
+      cryptoutils->get_bytes(Key.data(), ChunkSize);
+      for (size_t i = 0; i < ChunkSize; i++)
+        Encrypted[i] = Key[i] ^ Plain[Off + i];
+      FixedVectorType *VecTy =
+          FixedVectorType::get(builder.getInt8Ty(), ChunkSize);
+      Value *Ptr = builder.CreatePointerCast(
+          builder.CreateConstInBoundsGEP1_64(builder.getInt8Ty(), Base, Off),
+          VecTy->getPointerTo(StackString->getAddressSpace()));
+      Align ChunkAlign = commonAlignment(StackString->getAlign(), Off);
+      builder.CreateAlignedStore(
+          ConstantDataVector::get(Func->getContext(), Key), Ptr, ChunkAlign);
+      LoadInst *Chunk = builder.CreateAlignedLoad(VecTy, Ptr, ChunkAlign);
+      Value *XORed = builder.CreateXor(
+          Chunk, ConstantDataVector::get(Func->getContext(), Encrypted));
+      builder.CreateAlignedStore(XORed, Ptr, ChunkAlign);
+      Off += ChunkSize;
     }
 
     // Remove old rawGV references
@@ -207,8 +350,93 @@ void StackStringPass::HandleFunction(Function *Func) {
       GV->dropAllReferences();
       GV->eraseFromParent();
     }
-    builder.CreateBr(C);
   }
+  for (unsigned S = 0; S < GlobalStrings.size(); S++)
+    HandleGlobalString(GlobalStrings[S], GlobalInsertPts[S], Users);
 } // End of HandleFunction
 
+// Replace GV by a global decrypted from a keystream right before IP, the
+// first time any thread gets there. The other threads wait until the
+// winner of the status word is done.
+void StackStringPass::HandleGlobalString(GlobalVariable *GV, Instruction *IP,
+                                         std::set<User *> &Users) {
+  Module *M = GV->getParent();
+  LLVMContext &Ctx = M->getContext();
+  ConstantDataSequential *CDS =
+      cast<ConstantDataSequential>(GV->getInitializer());
+  std::string Data = targetBytes(CDS, M->getDataLayout());
+  // Seeds must be non-zero or xorshift gets stuck at zero
+  const uint64_t Seed = cryptoutils->get_uint64_t() | 1;
+  uint64_t State = Seed;
+  for (char &C : Data) {
+    State ^= State << 13;
+    State ^= State >> 7;
+    State ^= State << 17;
+    C ^= static_cast<uint8_t>(State);
+  }
+  Type *I8Ty = Type::getInt8Ty(Ctx);
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  Type *I64Ty = Type::getInt64Ty(Ctx);
+  GlobalVariable *EncryptedGV = new GlobalVariable(
+      *M, ArrayType::get(I8Ty, Data.size()), true,
+      GlobalValue::LinkageTypes::PrivateLinkage,
+      ConstantDataArray::getString(Ctx, Data, false), "EncryptedString");
+  GlobalVariable *DecryptSpace = new GlobalVariable(
+      *M, CDS->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
+      Constant::getNullValue(CDS->getType()), "DecryptSpace", nullptr,
+      GlobalValue::NotThreadLocal, GV->getType()->getAddressSpace());
+  GlobalVariable *StatusGV = new GlobalVariable(
+      *M, I32Ty, false, GlobalValue::LinkageTypes::PrivateLinkage,
+      ConstantInt::get(I32Ty, 0), "StringEncryptionEncStatus");
+  genedgv.emplace_back(EncryptedGV);
+  genedgv.emplace_back(DecryptSpace);
+  genedgv.emplace_back(StatusGV);
+
+  // 0: encrypted, 2: being decrypted, 1: decrypted
+  BasicBlock *Head = IP->getParent();
+  BasicBlock *Cont = SplitBlock(Head, IP);
+  Function *Func = Head->getParent();
+  BasicBlock *Decrypt = BasicBlock::Create(Ctx, "StringDecryptionBB", Func,
+                                           Cont);
+  BasicBlock *Claim = emitStatusClaim(StatusGV, Head, Decrypt, Cont);
+  IRBuilder<> IRB(Decrypt);
+  PHINode *Idx = IRB.CreatePHI(I64Ty, 2);
+  PHINode *KeyState = IRB.CreatePHI(I64Ty, 2, "KeystreamState");
+  Value *K = KeyState;
+  K = IRB.CreateXor(K, IRB.CreateShl(K, 13));
+  K = IRB.CreateXor(K, IRB.CreateLShr(K, 7));
+  K = IRB.CreateXor(K, IRB.CreateShl(K, 17));
+  Value *Enc = IRB.CreateLoad(
+      I8Ty, IRB.CreateInBoundsGEP(EncryptedGV->getValueType(), EncryptedGV,
+                                  {ConstantInt::get(I64Ty, 0), Idx}));
+  Value *Dst = IRB.CreateInBoundsGEP(
+      I8Ty,
+      IRB.CreatePointerCast(DecryptSpace,
+                            IRB.getInt8PtrTy(GV->getAddressSpace())),
+      Idx);
+  IRB.CreateStore(IRB.CreateXor(Enc, IRB.CreateTrunc(K, I8Ty)), Dst);
+  Value *Next = IRB.CreateAdd(Idx, ConstantInt::get(I64Ty, 1));
+  Idx->addIncoming(ConstantInt::get(I64Ty, 0), Claim);
+  Idx->addIncoming(Next, Decrypt);
+  KeyState->addIncoming(ConstantInt::get(I64Ty, Seed), Claim);
+  KeyState->addIncoming(K, Decrypt);
+  BasicBlock *Done = BasicBlock::Create(Ctx, "", Func, Cont);
+  IRB.CreateCondBr(
+      IRB.CreateICmpULT(Next, ConstantInt::get(I64Ty, Data.size())), Decrypt,
+      Done);
+  IRB.SetInsertPoint(Done);
+  StoreInst *SI = IRB.CreateStore(ConstantInt::get(I32Ty, 1), StatusGV);
+  SI->setAtomic(AtomicOrdering::Release);
+  SI->setAlignment(Align(4));
+  IRB.CreateBr(Cont);
+
+  for (User *U : Users)
+    U->replaceUsesOfWith(GV, DecryptSpace);
+  GV->removeDeadConstantUsers();
+  if (GV->getNumUses() == 0) {
+    GV->dropAllReferences();
+    GV->eraseFromParent();
+  }
+}
+
 }; // namespace llvm
\ No newline at end of file
@@ -19,6 +19,8 @@ public:
                            SmallVector<GlobalVariable *, 32> *Globals,
                            std::set<User *> *Users, bool *breakFor);
   void HandleFunction(Function *Func);
+  void HandleGlobalString(GlobalVariable *GV, Instruction *IP,
+                          std::set<User *> &Users);
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
   static bool isRequired() { return true; }
 };
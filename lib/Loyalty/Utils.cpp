@@ -2,12 +2,25 @@
 // [License](https://github.com/HikariObfuscator/Hikari/wiki/License).
 //===----------------------------------------------------------------------===//
 #include "Utils.h"
+#include "llvm/ADT/SmallBitVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#if LLVM_VERSION_MAJOR >= 17
+#include "llvm/TargetParser/Triple.h"
+#else
+#include "llvm/ADT/Triple.h"
+#endif
+#include "llvm/Demangle/Demangle.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/IntrinsicsAArch64.h"
+#include "llvm/IR/IntrinsicsX86.h"
 #include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/NoFolder.h"
+#include "llvm/IR/ValueMap.h"
+#include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include <set>
@@ -20,9 +33,8 @@ namespace llvm {
 // Shamefully borrowed from ../Scalar/RegToMem.cpp :(
 bool valueEscapes(Instruction *Inst) {
   BasicBlock *BB = Inst->getParent();
-  for (Value::use_iterator UI = Inst->use_begin(), E = Inst->use_end(); UI != E;
-       ++UI) {
-    Instruction *I = cast<Instruction>(*UI);
+  for (User *U : Inst->users()) {
+    Instruction *I = cast<Instruction>(U);
     if (I->getParent() != BB || isa<PHINode>(I)) {
       return true;
     }
@@ -30,10 +42,16 @@ bool valueEscapes(Instruction *Inst) {
   return false;
 }
 
-void fixStack(Function *f) {
-  // Try to remove phi node and demote reg to stack
+// Demote every value and PHI that lives across blocks to an entry-block
+// slot. Escaping values are found with one walk over the uses of each
+// instruction. Demotion itself only adds loads and stores next to their users,
+// so the only new cross-block value it can create is the reload of a PHI that
+// escaped, which is demoted right away instead of rescanning the function.
+// Returns the number of stack slots created.
+unsigned fixStack(Function *f) {
   SmallVector<PHINode *, 8> tmpPhi;
   SmallVector<Instruction *, 32> tmpReg;
+  SmallVector<AllocaInst *, 8> escapedPhi;
   BasicBlock *bbEntry = &*f->begin();
   // Find first non-alloca instruction and create insertion point. This is
   // safe if block is well-formed: it always have terminator, otherwise
@@ -42,45 +60,135 @@ void fixStack(Function *f) {
   while (isa<AllocaInst>(I))
     ++I;
   Instruction *AllocaInsertionPoint = &*I;
-  do {
-    tmpPhi.clear();
-    tmpReg.clear();
-    for (BasicBlock &i : *f) {
-      for (Instruction &j : i) {
-        if (isa<PHINode>(&j)) {
-          PHINode *phi = cast<PHINode>(&j);
-          tmpPhi.emplace_back(phi);
-          continue;
-        }
-        if (!(isa<AllocaInst>(&j) && j.getParent() == bbEntry) &&
-            (valueEscapes(&j) || j.isUsedOutsideOfBlock(&i))) {
-          tmpReg.emplace_back(&j);
-          continue;
-        }
+  for (BasicBlock &i : *f) {
+    for (Instruction &j : i) {
+      if (isa<PHINode>(&j)) {
+        tmpPhi.emplace_back(cast<PHINode>(&j));
+        continue;
       }
+      if (!(isa<AllocaInst>(&j) && &i == bbEntry) && valueEscapes(&j))
+        tmpReg.emplace_back(&j);
     }
-    for (Instruction *I : tmpReg)
-      DemoteRegToStack(*I, false, AllocaInsertionPoint);
-    for (PHINode *P : tmpPhi)
-      DemotePHIToStack(P, AllocaInsertionPoint);
-  } while (tmpReg.size() != 0 || tmpPhi.size() != 0);
+  }
+  for (Instruction *I : tmpReg)
+    DemoteRegToStack(*I, false, AllocaInsertionPoint);
+  for (PHINode *P : tmpPhi) {
+    bool escapes = valueEscapes(P);
+    AllocaInst *Slot = DemotePHIToStack(P, AllocaInsertionPoint);
+    if (escapes)
+      escapedPhi.emplace_back(Slot);
+  }
+  unsigned slots = tmpReg.size() + tmpPhi.size();
+  for (AllocaInst *Slot : escapedPhi)
+    for (User *U : Slot->users())
+      if (LoadInst *LI = dyn_cast<LoadInst>(U)) {
+        DemoteRegToStack(*LI, false, AllocaInsertionPoint);
+        ++slots;
+        break;
+      }
+  return slots;
 }
 
 // Unlike O-LLVM which uses __attribute__ that is not supported by the ObjC
 // CFE. We use a dummy call here and remove the call later Very dumb and
 // definitely slower than the function attribute method Merely a hack
-bool readFlag(Function *f, std::string attribute) {
-  for (Instruction &I : instructions(f)) {
-    Instruction *Inst = &I;
-    if (CallInst *CI = dyn_cast<CallInst>(Inst)) {
-      if (CI->getCalledFunction() != nullptr &&
-          CI->getCalledFunction()->getName().contains("hikari_" + attribute)) {
-        CI->eraseFromParent();
-        return true;
-      }
-    }
+static const char obfkindid[] = "MD_obf";
+
+namespace {
+// Everything the toObfuscate* queries used to dig out of a function on every
+// call: its MD_obf strings and its hikari_* marker calls. Names are interned
+// module-wide so a function's flags are a small bit vector, and the handful of
+// uint32 options live next to it keyed by the same ids.
+struct FunctionFlags {
+  SmallBitVector Flags;
+  SmallDenseMap<unsigned, uint32_t, 4> Options;
+};
+
+struct ObfuscationIndex {
+  StringMap<unsigned> Names;
+  ValueMap<const Function *, FunctionFlags> Functions;
+
+  unsigned intern(StringRef Name) {
+    return Names.try_emplace(Name, Names.size()).first->second;
   }
-  return false;
+  int lookup(StringRef Name) const {
+    auto It = Names.find(Name);
+    return It == Names.end() ? -1 : (int)It->second;
+  }
+  void setFlag(FunctionFlags &FF, StringRef Name) {
+    unsigned Id = intern(Name);
+    if (FF.Flags.size() <= Id)
+      FF.Flags.resize(Id + 1);
+    FF.Flags.set(Id);
+  }
+  void addString(FunctionFlags &FF, StringRef Str) {
+    size_t Eq = Str.find('=');
+    if (Eq == StringRef::npos)
+      setFlag(FF, Str);
+    else
+      FF.Options[intern(Str.substr(0, Eq))] =
+          atoi(Str.substr(Eq + 1).str().c_str());
+  }
+  FunctionFlags &get(Function *f);
+};
+} // namespace
+
+static ManagedStatic<ObfuscationIndex> Index;
+
+// Marker calls such as hikari_fla() or hikari_bcf_prob(40) are consumed the
+// first time the function is indexed. C++ callers get a mangled name, so the
+// marker is read from the demangled one.
+static StringRef markerName(StringRef Callee, std::string &Storage) {
+  if (Callee.startswith("_Z")) {
+    Storage = demangle(Callee.str());
+    Callee = Storage;
+  }
+  size_t Pos = Callee.find("hikari_");
+  if (Pos == StringRef::npos)
+    return StringRef();
+  Callee = Callee.substr(Pos + strlen("hikari_"));
+  return Callee.take_while([](char C) { return isAlnum(C) || C == '_'; });
+}
+
+FunctionFlags &ObfuscationIndex::get(Function *f) {
+  auto It = Functions.find(f);
+  if (It != Functions.end())
+    return It->second;
+  FunctionFlags &FF = Functions[f];
+  if (MDNode *Existing = f->getMetadata(obfkindid))
+    for (auto &N : cast<MDTuple>(Existing)->operands())
+      addString(FF, cast<MDString>(N.get())->getString());
+  SmallVector<CallInst *, 4> Markers;
+  for (Instruction &I : instructions(f))
+    if (CallInst *CI = dyn_cast<CallInst>(&I)) {
+      Function *Callee = CI->getCalledFunction();
+      if (!Callee || !Callee->getName().contains("hikari_"))
+        continue;
+      std::string Storage;
+      StringRef Name = markerName(Callee->getName(), Storage);
+      if (Name.empty())
+        continue;
+      ConstantInt *C = nullptr;
+      if (CI->arg_size())
+        C = dyn_cast<ConstantInt>(CI->getArgOperand(0));
+      if (C)
+        FF.Options[intern(Name)] = (uint32_t)C->getValue().getZExtValue();
+      else
+        setFlag(FF, Name);
+      Markers.emplace_back(CI);
+    }
+  for (CallInst *CI : Markers)
+    CI->eraseFromParent();
+  return FF;
+}
+
+static bool readFlag(Function *f, std::string attribute) {
+  // Indexing f interns its names, so it has to happen before the lookup
+  FunctionFlags &FF = Index->get(f);
+  int Id = Index->lookup(attribute);
+  if (Id < 0)
+    return false;
+  return (unsigned)Id < FF.Flags.size() && FF.Flags.test(Id);
 }
 
 bool toObfuscate(bool flag, Function *f, std::string attribute) {
@@ -90,10 +198,10 @@ bool toObfuscate(bool flag, Function *f, std::string attribute) {
   }
   std::string attr = attribute;
   std::string attrNo = "no" + attr;
-  if (readAnnotationMetadata(f, attrNo) || readFlag(f, attrNo)) {
+  if (readFlag(f, attrNo)) {
     return false;
   }
-  if (readAnnotationMetadata(f, attr) || readFlag(f, attr)) {
+  if (readFlag(f, attr)) {
     return true;
   }
   return flag;
@@ -102,58 +210,27 @@ bool toObfuscate(bool flag, Function *f, std::string attribute) {
 bool toObfuscateBoolOption(Function *f, std::string option, bool *val) {
   std::string opt = option;
   std::string optDisable = "no" + option;
-  if (readAnnotationMetadata(f, optDisable) || readFlag(f, optDisable)) {
+  if (readFlag(f, optDisable)) {
     *val = false;
     return true;
   }
-  if (readAnnotationMetadata(f, opt) || readFlag(f, opt)) {
+  if (readFlag(f, opt)) {
     *val = true;
     return true;
   }
   return false;
 }
 
-static const char obfkindid[] = "MD_obf";
-
-bool readAnnotationMetadataUint32OptVal(Function *f, std::string opt,
-                                        uint32_t *val) {
-  MDNode *Existing = f->getMetadata(obfkindid);
-  if (Existing) {
-    MDTuple *Tuple = cast<MDTuple>(Existing);
-    for (auto &N : Tuple->operands()) {
-      StringRef mdstr = cast<MDString>(N.get())->getString();
-      std::string estr = opt + "=";
-      if (mdstr.startswith(estr)) {
-        *val = atoi(mdstr.substr(strlen(estr.c_str())).str().c_str());
-        return true;
-      }
-    }
-  }
-  return false;
-}
-
-bool readFlagUint32OptVal(Function *f, std::string opt, uint32_t *val) {
-  for (Instruction &I : instructions(f)) {
-    Instruction *Inst = &I;
-    if (CallInst *CI = dyn_cast<CallInst>(Inst)) {
-      if (CI->getCalledFunction() != nullptr &&
-          CI->getCalledFunction()->getName().contains("hikari_" + opt)) {
-        if (ConstantInt *C = dyn_cast<ConstantInt>(CI->getArgOperand(0))) {
-          *val = (uint32_t)C->getValue().getZExtValue();
-          CI->eraseFromParent();
-          return true;
-        }
-      }
-    }
-  }
-  return false;
-}
-
 bool toObfuscateUint32Option(Function *f, std::string option, uint32_t *val) {
-  if (readAnnotationMetadataUint32OptVal(f, option, val) ||
-      readFlagUint32OptVal(f, option, val))
-    return true;
-  return false;
+  FunctionFlags &FF = Index->get(f);
+  int Id = Index->lookup(option);
+  if (Id < 0)
+    return false;
+  auto It = FF.Options.find(Id);
+  if (It == FF.Options.end())
+    return false;
+  *val = It->second;
+  return true;
 }
 
 bool hasApplePtrauth(Module *M) {
@@ -241,17 +318,14 @@ void annotation2Metadata(Module &M) {
       for (std::string str : strs)
         writeAnnotationMetadata(Fn, str);
     }
+  // Index every function up front so that no pass has to rescan one
+  for (Function &F : M)
+    if (!F.isDeclaration())
+      Index->get(&F);
 }
 
 bool readAnnotationMetadata(Function *f, std::string annotation) {
-  MDNode *Existing = f->getMetadata(obfkindid);
-  if (Existing) {
-    MDTuple *Tuple = cast<MDTuple>(Existing);
-    for (auto &N : Tuple->operands())
-      if (cast<MDString>(N.get())->getString() == annotation)
-        return true;
-  }
-  return false;
+  return readFlag(f, annotation);
 }
 
 void writeAnnotationMetadata(Function *f, std::string annotation) {
@@ -274,6 +348,10 @@ void writeAnnotationMetadata(Function *f, std::string annotation) {
 
   MDNode *MD = MDTuple::get(Context, Names);
   f->setMetadata(obfkindid, MD);
+
+  auto It = Index->Functions.find(f);
+  if (AppendName && It != Index->Functions.end())
+    Index->addString(It->second, annotation);
 }
 
 bool AreUsersInOneFunction(GlobalVariable *GV) {
@@ -294,6 +372,85 @@ bool AreUsersInOneFunction(GlobalVariable *GV) {
   return userFunctions.size() <= 1;
 }
 
+// Whether every use of GV, looking through constant expressions, is an
+// instruction of F
+bool onlyUsedIn(Constant *GV, Function *F) {
+  for (User *U : GV->users()) {
+    if (Instruction *I = dyn_cast<Instruction>(U)) {
+      if (I->getFunction() != F)
+        return false;
+    } else if (ConstantExpr *CE = dyn_cast<ConstantExpr>(U)) {
+      if (!onlyUsedIn(CE, F))
+        return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// StatusGV moves from 0 (not run) to 2 (running) to 1 (done). From goes to
+// Ready once it reads 1, and otherwise to a block that claims StatusGV with
+// a cmpxchg from 0 to 2 and runs Run, which has to store 1 with release
+// ordering when done. The callers losing the claim spin with the CPU's
+// pause hint, giving their time slice away every 64 spins where the target
+// has sched_yield, until they read 1. The waiting is not reentrant: a
+// signal handler getting there on the thread that is running Run waits
+// forever.
+BasicBlock *emitStatusClaim(GlobalVariable *StatusGV, BasicBlock *From,
+                            BasicBlock *Run, BasicBlock *Ready) {
+  Function *Func = From->getParent();
+  Module *M = Func->getParent();
+  LLVMContext &Ctx = Func->getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Triple T(M->getTargetTriple());
+  BasicBlock *Claim = BasicBlock::Create(Ctx, "ClaimDecryption", Func, Run);
+  BasicBlock *Wait = BasicBlock::Create(Ctx, "WaitForDecryption", Func, Run);
+  BasicBlock *Spin = BasicBlock::Create(Ctx, "SpinForDecryption", Func, Run);
+  BasicBlock *Yield = BasicBlock::Create(Ctx, "YieldForDecryption", Func, Run);
+  From->getTerminator()->eraseFromParent();
+  IRBuilder<> IRB(From);
+  auto IsReady = [&]() {
+    LoadInst *LI = IRB.CreateLoad(Int32Ty, StatusGV, "LoadEncryptionStatus");
+    LI->setAtomic(AtomicOrdering::Acquire);
+    LI->setAlignment(Align(4));
+    return IRB.CreateICmpEQ(LI, ConstantInt::get(Int32Ty, 1));
+  };
+  IRB.CreateCondBr(IsReady(), Ready, Claim);
+
+  IRB.SetInsertPoint(Claim);
+  AtomicCmpXchgInst *CAS = IRB.CreateAtomicCmpXchg(
+      StatusGV, ConstantInt::get(Int32Ty, 0), ConstantInt::get(Int32Ty, 2),
+      MaybeAlign(4), AtomicOrdering::Acquire, AtomicOrdering::Acquire);
+  IRB.CreateCondBr(IRB.CreateExtractValue(CAS, 1), Run, Wait);
+
+  IRB.SetInsertPoint(Wait);
+  PHINode *Spins = IRB.CreatePHI(Int32Ty, 3, "DecryptionSpins");
+  IRB.CreateCondBr(IsReady(), Ready, Spin);
+
+  IRB.SetInsertPoint(Spin);
+  if (T.isX86())
+    IRB.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::x86_sse2_pause));
+  else if (T.isAArch64())
+    IRB.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::aarch64_hint),
+                   {ConstantInt::get(Int32Ty, 1)}); // YIELD
+  Value *NextSpins = IRB.CreateAdd(Spins, ConstantInt::get(Int32Ty, 1));
+  IRB.CreateCondBr(
+      IRB.CreateICmpULT(NextSpins, ConstantInt::get(Int32Ty, 64)), Wait,
+      Yield);
+
+  IRB.SetInsertPoint(Yield);
+  if (T.isOSLinux() || T.isOSDarwin() || T.isOSFreeBSD())
+    IRB.CreateCall(M->getOrInsertFunction(
+        "sched_yield", FunctionType::get(Int32Ty, false)));
+  IRB.CreateBr(Wait);
+
+  Spins->addIncoming(ConstantInt::get(Int32Ty, 0), Claim);
+  Spins->addIncoming(NextSpins, Spin);
+  Spins->addIncoming(ConstantInt::get(Int32Ty, 0), Yield);
+  return Claim;
+}
+
 #if 0
 std::map<GlobalValue *, StringRef> BuildAnnotateMap(Module &M) {
   std::map<GlobalValue *, StringRef> VAMap;
@@ -6,7 +6,7 @@
 
 namespace llvm {
 
-void fixStack(Function *f);
+unsigned fixStack(Function *f);
 bool toObfuscate(bool flag, Function *f, std::string attribute);
 bool toObfuscateBoolOption(Function *f, std::string option, bool *val);
 bool toObfuscateUint32Option(Function *f, std::string option, uint32_t *val);
@@ -17,6 +17,9 @@ void annotation2Metadata(Module &M);
 bool readAnnotationMetadata(Function *f, std::string annotation);
 void writeAnnotationMetadata(Function *f, std::string annotation);
 bool AreUsersInOneFunction(GlobalVariable *GV);
+bool onlyUsedIn(Constant *GV, Function *F);
+BasicBlock *emitStatusClaim(GlobalVariable *StatusGV, BasicBlock *From,
+                            BasicBlock *Run, BasicBlock *Ready);
 #if 0
 std::map<GlobalValue*, StringRef> BuildAnnotateMap(Module& M);
 #endif